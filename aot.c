@@ -0,0 +1,759 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "aot.h"
+#include "assembler.h"
+
+/* ahead of time compiler, translates a verified program into C that runs
+ * on the runtime (build/libspy.a) without the interpreter.  every function
+ * becomes a C function taking its arguments as parameters, and its frame
+ * (locals, then whatever it pushes) an array indexed by stack depth, which
+ * is the same on every path to an instruction.  frames that lea takes the
+ * address of stay on the vm stack so the address means the same thing.
+ * C functions are looked up once, when the program starts
+ */
+
+typedef struct SpyAOT SpyAOT;
+
+struct SpyAOT {
+	SpyState*	S;
+	FILE*		out;
+	size_t		cells;
+	uint32_t*	offsets;	/* bytecode offset of each cell */
+	uint8_t*	is_function;
+	uint8_t*	results;	/* function returns a value */
+	int64_t*	nargs;		/* arguments every call to a function passes */
+	uint8_t*	reached;	/* cells of the function being translated */
+	uint8_t*	is_target;	/* ... that are jumped to */
+	int64_t*	depth;		/* ... and the stack depth before each */
+	uint32_t*	work;
+};
+
+static void
+SpyAOT_fail(const SpyAOT* A, size_t cell, const char* message) {
+	Spy_crash(A->S, "'%s' at 0x%x %s", instructions[A->S->code_ops[cell]].name, A->offsets[cell], message);
+}
+
+/* writes one line of the function being translated */
+static void
+SpyAOT_line(SpyAOT* A, const char* format, ...) {
+	va_list list;
+	va_start(list, format);
+	fputc('\t', A->out);
+	vfprintf(A->out, format, list);
+	fputc('\n', A->out);
+	va_end(list);
+}
+
+/* (value) as a C constant, in (buffer) */
+static const char*
+SpyAOT_literal(char* buffer, int64_t value) {
+	if (value >= -0x7FFFFFFF && value <= 0x7FFFFFFF) {
+		sprintf(buffer, "%lld", (long long)value);
+	} else {
+		sprintf(buffer, "(int64_t)0x%llxull", (unsigned long long)value);
+	}
+	return buffer;
+}
+
+/* frame slot an operand addresses, they're threaded as byte offsets from bp */
+static int64_t
+SpyAOT_slot(const SpyCell* operand) {
+	return (operand->i - 8) / 8;
+}
+
+static size_t
+SpyAOT_next(const SpyAOT* A, size_t cell) {
+	do {
+		cell++;
+	} while (cell < A->cells && A->S->code_ops[cell] == SPY_OPERAND);
+	return cell;
+}
+
+/* cells control goes to after (cell), returns how many.  (jump) is set to
+ * the target of a jump, or to (cell) when it doesn't jump
+ */
+static int
+SpyAOT_successors(const SpyAOT* A, size_t cell, size_t* next, size_t* jump) {
+	const SpyCell* operands = &A->S->code[cell + 1];
+	*jump = cell;
+	switch (A->S->code_ops[cell]) {
+		case OP_JMP:
+			*jump = next[0] = operands[0].target - A->S->code;
+			return 1;
+		case OP_JZ: case OP_JNZ: case OP_ILTJZ: case OP_ILEJZ:
+		case OP_ICMPJZ:
+			*jump = next[0] = operands[0].target - A->S->code;
+			next[1] = SpyAOT_next(A, cell);
+			return 2;
+		case OP_IRET: case OP_FRET: case OP_VRET: case OP_TAILCALL:
+		case OP_NOOP:
+			return 0;
+		case OP_CJNZ: case OP_CJZ: case OP_CJMP:
+			SpyAOT_fail(A, cell, "jumps to a computed address, which only the interpreter can do");
+			return 0;
+		case OP_COCREATE: case OP_RESUME: case OP_YIELD: case OP_COSTATUS:
+			SpyAOT_fail(A, cell, "needs coroutines, which only the interpreter has");
+			return 0;
+	}
+	next[0] = SpyAOT_next(A, cell);
+	return 1;
+}
+
+/* marks the cells of the function at (entry), everything reachable from
+ * it without returning
+ */
+static void
+SpyAOT_reach(SpyAOT* A, size_t entry) {
+	size_t n = 0;
+	memset(A->reached, 0, A->cells);
+	memset(A->is_target, 0, A->cells);
+	A->reached[entry] = 1;
+	A->work[n++] = entry;
+	while (n > 0) {
+		size_t cell = A->work[--n];
+		size_t next[2], jump;
+		int count = SpyAOT_successors(A, cell, next, &jump);
+		if (jump != cell) {
+			A->is_target[jump] = 1;
+		}
+		for (int i = 0; i < count; i++) {
+			if (!A->reached[next[i]]) {
+				A->reached[next[i]] = 1;
+				A->work[n++] = next[i];
+			}
+		}
+	}
+}
+
+/* stack depth before each cell of the function at (entry), returns the
+ * deepest its frame gets
+ */
+static int64_t
+SpyAOT_measure(SpyAOT* A, size_t entry) {
+	size_t n = 0;
+	int64_t deepest = 0;
+	for (size_t i = 0; i < A->cells; i++) {
+		A->depth[i] = -1;
+	}
+	A->depth[entry] = 0;
+	A->work[n++] = entry;
+	while (n > 0) {
+		size_t cell = A->work[--n];
+		size_t next[2], jump;
+		int64_t pops, pushes;
+		Spy_stackEffect(A->S, cell, A->results, &pops, &pushes);
+		if (pops > A->depth[cell]) {
+			SpyAOT_fail(A, cell, "pops more than its function pushed");
+		}
+		int64_t after = A->depth[cell] - pops + pushes;
+		if (after > deepest) deepest = after;
+		if (A->depth[cell] > deepest) deepest = A->depth[cell];
+		int count = SpyAOT_successors(A, cell, next, &jump);
+		for (int i = 0; i < count; i++) {
+			if (A->depth[next[i]] < 0) {
+				A->depth[next[i]] = after;
+				A->work[n++] = next[i];
+			} else if (A->depth[next[i]] != after) {
+				SpyAOT_fail(A, next[i], "is reached with different stack depths");
+			}
+		}
+	}
+	return deepest;
+}
+
+static const char*
+SpyAOT_operator(uint8_t op) {
+	switch (op) {
+		case OP_IADD: case OP_FADD: case OP_RIADD: case OP_RFADD:
+		case OP_VFADD: case OP_VIADD: case OP_PADD: case OP_FLLADD:
+			return "+";
+		case OP_ISUB: case OP_FSUB: case OP_RISUB: case OP_RFSUB:
+		case OP_VFSUB: case OP_VISUB: case OP_PSUB: case OP_FLLSUB:
+			return "-";
+		case OP_IMUL: case OP_FMUL: case OP_RIMUL: case OP_RFMUL:
+		case OP_VFMUL: case OP_VIMUL: case OP_FLLMUL:
+			return "*";
+		case OP_IDIV: case OP_FDIV: case OP_RIDIV: case OP_RFDIV:
+		case OP_VFDIV:
+			return "/";
+		case OP_MOD: return "%";
+		case OP_SHL: return "<<";
+		case OP_SHR: return ">>";
+		case OP_AND: return "&";
+		case OP_OR: return "|";
+		case OP_XOR: return "^";
+		case OP_IGT: case OP_FGT: return ">";
+		case OP_IGE: case OP_FGE: return ">=";
+		case OP_ILT: case OP_FLT: return "<";
+		case OP_ILE: case OP_FLE: return "<=";
+		case OP_ICMP: case OP_FCMP: return "==";
+		case OP_LOR: return "||";
+		case OP_LAND: return "&&";
+	}
+	return NULL;
+}
+
+/* lane comparison of vfcmp and vicmp */
+static const char*
+SpyAOT_comparison(int64_t cond) {
+	static const char* operators[] = {"==", "!=", "<", "<=", ">", ">="};
+	return operators[cond];
+}
+
+static const char*
+SpyAOT_mathFunction(uint8_t op) {
+	switch (op) {
+		case OP_FSQRT: return "sqrt";
+		case OP_FSIN: return "sin";
+		case OP_FCOS: return "cos";
+		case OP_FTAN: return "tan";
+		case OP_FABS: return "fabs";
+		case OP_FFLOOR: return "floor";
+		case OP_FCEIL: return "ceil";
+	}
+	return NULL;
+}
+
+/* the call in a call or tailcall instruction at (cell) with (d) values on the stack */
+static void
+SpyAOT_call(SpyAOT* A, char* buffer, size_t cell, int64_t d) {
+	const SpyCell* operands = &A->S->code[cell + 1];
+	int64_t n = operands[1].i;
+	buffer += sprintf(buffer, "spy_%x(S", A->offsets[operands[0].target - A->S->code]);
+	for (int64_t i = d - n; i < d; i++) {
+		buffer += sprintf(buffer, ", s[%lld]", (long long)i);
+	}
+	sprintf(buffer, ")");
+}
+
+/* one instruction of a function, (leave) is what its returns do first */
+static void
+SpyAOT_instruction(SpyAOT* A, size_t cell, int is_entry, int64_t nargs, const char* leave) {
+	SpyState* S = A->S;
+	const SpyCell* o = &S->code[cell + 1];
+	uint8_t op = S->code_ops[cell];
+	long long d = A->depth[cell];
+	char lit[32];
+	char call[4096];
+
+	if (op == OP_CALL || op == OP_TAILCALL) {
+		if (o[1].i > 200) {
+			SpyAOT_fail(A, cell, "passes too many arguments");
+		}
+		SpyAOT_call(A, call, cell, d);
+	}
+
+	switch (op) {
+		case OP_NOOP:
+			/* the end of the code, which stops the program wherever it's reached */
+			SpyAOT_line(A, is_entry ? "return 0;" : "exit(0);");
+			break;
+		case OP_IPUSH: case OP_FPUSH:
+			SpyAOT_line(A, "s[%lld] = %s;", d, SpyAOT_literal(lit, o[0].i));
+			break;
+		case OP_IADD: case OP_ISUB: case OP_IMUL: case OP_SHL:
+			/* wrapped like the interpreter's, signed overflow would be undefined */
+			SpyAOT_line(A, "s[%lld] = (int64_t)((uint64_t)s[%lld] %s (uint64_t)s[%lld]);", d - 2, d - 2, SpyAOT_operator(op), d - 1);
+			break;
+		case OP_IDIV: case OP_MOD: case OP_SHR: case OP_AND:
+		case OP_OR: case OP_XOR: case OP_IGT: case OP_IGE:
+		case OP_ILT: case OP_ILE: case OP_ICMP: case OP_LOR:
+		case OP_LAND:
+			SpyAOT_line(A, "s[%lld] = s[%lld] %s s[%lld];", d - 2, d - 2, SpyAOT_operator(op), d - 1);
+			break;
+		case OP_PADD: case OP_PSUB:
+			SpyAOT_line(A, "s[%lld] = (int64_t)((uint64_t)s[%lld] %s (uint64_t)s[%lld]*8);", d - 2, d - 2, SpyAOT_operator(op), d - 1);
+			break;
+		case OP_NOT:
+			SpyAOT_line(A, "s[%lld] = ~s[%lld];", d - 1, d - 1);
+			break;
+		case OP_NEG:
+			SpyAOT_line(A, "s[%lld] = (int64_t)(0 - (uint64_t)s[%lld]);", d - 1, d - 1);
+			break;
+		case OP_LNOT:
+			SpyAOT_line(A, "s[%lld] = !s[%lld];", d - 1, d - 1);
+			break;
+		case OP_JNZ:
+			SpyAOT_line(A, "if (s[%lld]) goto L%x;", d - 1, A->offsets[o[0].target - S->code]);
+			break;
+		case OP_JZ:
+			SpyAOT_line(A, "if (!s[%lld]) goto L%x;", d - 1, A->offsets[o[0].target - S->code]);
+			break;
+		case OP_JMP:
+			SpyAOT_line(A, "goto L%x;", A->offsets[o[0].target - S->code]);
+			break;
+		case OP_ILTJZ:
+			SpyAOT_line(A, "if (!(s[%lld] < s[%lld])) goto L%x;", d - 2, d - 1, A->offsets[o[0].target - S->code]);
+			break;
+		case OP_ILEJZ:
+			SpyAOT_line(A, "if (!(s[%lld] <= s[%lld])) goto L%x;", d - 2, d - 1, A->offsets[o[0].target - S->code]);
+			break;
+		case OP_ICMPJZ:
+			SpyAOT_line(A, "if (s[%lld] != s[%lld]) goto L%x;", d - 2, d - 1, A->offsets[o[0].target - S->code]);
+			break;
+		case OP_CALL:
+			if (A->results[o[0].target - S->code]) {
+				SpyAOT_line(A, "s[%lld] = %s;", d - o[1].i, call);
+			} else {
+				SpyAOT_line(A, "%s;", call);
+			}
+			break;
+		case OP_TAILCALL:
+			/* the arguments are read before the callee can use the frame */
+			if (A->results[o[0].target - S->code]) {
+				SpyAOT_line(A, "%sreturn %s;", leave, call);
+			} else {
+				SpyAOT_line(A, "%s%s;", leave, call);
+				SpyAOT_line(A, "return 0;");
+			}
+			break;
+		case OP_IRET: case OP_FRET:
+			SpyAOT_line(A, "%sreturn s[%lld];", leave, d - 1);
+			break;
+		case OP_VRET:
+			SpyAOT_line(A, "%sreturn 0;", leave);
+			break;
+		case OP_CCALL:
+		{
+			/* on the vm stack first argument on top, as the interpreter leaves them */
+			int64_t n = o[1].i;
+			int64_t results = o[2].i;
+			SpyAOT_line(A, "{");
+			SpyAOT_line(A, "\tuint8_t* top = S->sp;");
+			SpyAOT_line(A, "\tint64_t* v = (int64_t *)(top + 8);");
+			for (int64_t i = 0; i < n; i++) {
+				SpyAOT_line(A, "\tv[%lld] = s[%lld];", (long long)i, d - 1 - i);
+			}
+			SpyAOT_line(A, "\tS->sp = top + %lld;", (long long)n*8);
+			SpyAOT_line(A, "\tspy_c%lld(S);", (long long)o[0].i);
+			for (int64_t i = 0; i < results; i++) {
+				SpyAOT_line(A, "\ts[%lld] = v[%lld];", d - n + i, (long long)i);
+			}
+			SpyAOT_line(A, "\tS->sp = top;");
+			SpyAOT_line(A, "}");
+			break;
+		}
+		case OP_FADD: case OP_FSUB: case OP_FMUL: case OP_FDIV:
+		case OP_FGT: case OP_FGE: case OP_FLT: case OP_FLE:
+			SpyAOT_line(A, "s[%lld] = spy_bits(spy_float(s[%lld]) %s spy_float(s[%lld]));", d - 2, d - 2, SpyAOT_operator(op), d - 1);
+			break;
+		case OP_FCMP:
+			SpyAOT_line(A, "s[%lld] = spy_float(s[%lld]) == spy_float(s[%lld]);", d - 2, d - 2, d - 1);
+			break;
+		case OP_ILLOAD: case OP_FLLOAD:
+			SpyAOT_line(A, "s[%lld] = s[%lld];", d, SpyAOT_slot(&o[0]));
+			break;
+		case OP_ILSAVE: case OP_FLSAVE:
+			SpyAOT_line(A, "s[%lld] = s[%lld];", SpyAOT_slot(&o[0]), d - 1);
+			break;
+		case OP_IARG:
+			if (is_entry) {
+				SpyAOT_line(A, "s[%lld] = *(int64_t *)(B - %lld);", d, (long long)(3*8 + o[0].i*8));
+			} else {
+				SpyAOT_line(A, "s[%lld] = p%lld;", d, (long long)(nargs - 1 - o[0].i));
+			}
+			break;
+		case OP_ILOAD: case OP_IDER: case OP_FDER:
+			SpyAOT_line(A, "s[%lld] = *(int64_t *)&M[s[%lld]];", d - 1, d - 1);
+			break;
+		case OP_CDER:
+			SpyAOT_line(A, "s[%lld] = M[s[%lld]];", d - 1, d - 1);
+			break;
+		case OP_ISAVE: case OP_FSAVE:
+			SpyAOT_line(A, "*(int64_t *)&M[s[%lld]] = s[%lld];", d - 2, d - 1);
+			break;
+		case OP_RES: case OP_ENTER:
+			/* the frame is sized (and checked) on entry */
+			break;
+		case OP_LEA:
+			SpyAOT_line(A, "s[%lld] = (uint8_t *)&s[%lld] - M;", d, SpyAOT_slot(&o[0]));
+			break;
+		case OP_ICINC:
+			SpyAOT_line(A, "s[%lld] = (int64_t)((uint64_t)s[%lld] + %s);", d - 1, d - 1, SpyAOT_literal(lit, o[0].i));
+			break;
+		case OP_LOG:
+			SpyAOT_line(A, "printf(\"%%llu\\n\", %lluull);", (unsigned long long)o[0].i);
+			break;
+		case OP_DBON: case OP_DBOFF: case OP_DBDS:
+			/* the debugger is the interpreter's */
+			break;
+		case OP_ILNSAVE:
+		{
+			int64_t slot = SpyAOT_slot(&o[0]);
+			int64_t n = o[1].i;
+			for (int64_t i = 0; i < n; i++) {
+				int64_t k = slot <= d - n ? i : n - 1 - i;
+				SpyAOT_line(A, "s[%lld] = s[%lld];", (long long)(slot + k), (long long)(d - n + k));
+			}
+			break;
+		}
+		case OP_ILNLOAD:
+			break;
+		case OP_FTOI:
+			SpyAOT_line(A, "s[%lld] = (int64_t)spy_float(s[%lld]);", d - 1 - o[0].i, d - 1 - o[0].i);
+			break;
+		case OP_ITOF:
+			SpyAOT_line(A, "s[%lld] = spy_bits((double)s[%lld]);", d - 1 - o[0].i, d - 1 - o[0].i);
+			break;
+		case OP_RISET: case OP_RFSET:
+			SpyAOT_line(A, "s[%lld] = %s;", SpyAOT_slot(&o[0]), SpyAOT_literal(lit, o[1].i));
+			break;
+		case OP_RMOV:
+			SpyAOT_line(A, "s[%lld] = s[%lld];", SpyAOT_slot(&o[0]), SpyAOT_slot(&o[1]));
+			break;
+		case OP_RIADD: case OP_RISUB: case OP_RIMUL:
+			SpyAOT_line(A, "s[%lld] = (int64_t)((uint64_t)s[%lld] %s (uint64_t)s[%lld]);", SpyAOT_slot(&o[0]), SpyAOT_slot(&o[1]), SpyAOT_operator(op), SpyAOT_slot(&o[2]));
+			break;
+		case OP_RIDIV:
+			SpyAOT_line(A, "s[%lld] = s[%lld] / s[%lld];", SpyAOT_slot(&o[0]), SpyAOT_slot(&o[1]), SpyAOT_slot(&o[2]));
+			break;
+		case OP_RFADD: case OP_RFSUB: case OP_RFMUL: case OP_RFDIV:
+			SpyAOT_line(A, "s[%lld] = spy_bits(spy_float(s[%lld]) %s spy_float(s[%lld]));", SpyAOT_slot(&o[0]), SpyAOT_slot(&o[1]), SpyAOT_operator(op), SpyAOT_slot(&o[2]));
+			break;
+		case OP_ILLADD:
+			SpyAOT_line(A, "s[%lld] = (int64_t)((uint64_t)s[%lld] + (uint64_t)s[%lld]);", d, SpyAOT_slot(&o[0]), SpyAOT_slot(&o[1]));
+			break;
+		case OP_FLLADD: case OP_FLLSUB: case OP_FLLMUL:
+			SpyAOT_line(A, "s[%lld] = spy_bits(spy_float(s[%lld]) %s spy_float(s[%lld]));", d, SpyAOT_slot(&o[0]), SpyAOT_operator(op), SpyAOT_slot(&o[1]));
+			break;
+		case OP_ILINC:
+			SpyAOT_line(A, "s[%lld] = (int64_t)((uint64_t)s[%lld] + %s);", d, SpyAOT_slot(&o[0]), SpyAOT_literal(lit, o[1].i));
+			break;
+		case OP_ILFIELD: case OP_FLFIELD:
+			SpyAOT_line(A, "s[%lld] = *(int64_t *)&M[s[%lld] + %s];", d, SpyAOT_slot(&o[0]), SpyAOT_literal(lit, o[1].i));
+			break;
+		case OP_ICIDER: case OP_ICFDER:
+			SpyAOT_line(A, "s[%lld] = *(int64_t *)&M[s[%lld] + %s];", d - 1, d - 1, SpyAOT_literal(lit, o[0].i));
+			break;
+		case OP_RIADDI:
+			SpyAOT_line(A, "s[%lld] = %s;", SpyAOT_slot(&o[0]), SpyAOT_literal(lit, o[1].i));
+			SpyAOT_line(A, "s[%lld] = (int64_t)((uint64_t)s[%lld] + %s);", SpyAOT_slot(&o[2]), SpyAOT_slot(&o[3]), lit);
+			break;
+		case OP_MEMCPY:
+			SpyAOT_line(A, "{");
+			SpyAOT_line(A, "\tuint8_t* src = spy_block(S, s[%lld], s[%lld]);", d - 2, d - 1);
+			SpyAOT_line(A, "\tuint8_t* dst = spy_block(S, s[%lld], s[%lld]);", d - 3, d - 1);
+			SpyAOT_line(A, "\tif (dst != src) memcpy(dst, src, s[%lld]);", d - 1);
+			SpyAOT_line(A, "}");
+			break;
+		case OP_MEMSET:
+			SpyAOT_line(A, "memset(spy_block(S, s[%lld], s[%lld]), (int)s[%lld], s[%lld]);", d - 3, d - 1, d - 2, d - 1);
+			break;
+		case OP_MEMMOVE:
+			SpyAOT_line(A, "{");
+			SpyAOT_line(A, "\tuint8_t* src = spy_block(S, s[%lld], s[%lld]);", d - 2, d - 1);
+			SpyAOT_line(A, "\tmemmove(spy_block(S, s[%lld], s[%lld]), src, s[%lld]);", d - 3, d - 1, d - 1);
+			SpyAOT_line(A, "}");
+			break;
+		case OP_VLLOAD:
+			for (int i = 0; i < 4; i++) {
+				SpyAOT_line(A, "s[%lld] = s[%lld];", d + i, SpyAOT_slot(&o[0]) + i);
+			}
+			break;
+		case OP_VLSAVE:
+			for (int i = 0; i < 4; i++) {
+				SpyAOT_line(A, "s[%lld] = s[%lld];", SpyAOT_slot(&o[0]) + i, d - 4 + i);
+			}
+			break;
+		case OP_VLOAD:
+			SpyAOT_line(A, "{");
+			SpyAOT_line(A, "\tint64_t* p = (int64_t *)&M[s[%lld]];", d - 1);
+			for (int i = 0; i < 4; i++) {
+				SpyAOT_line(A, "\ts[%lld] = p[%d];", d - 1 + i, i);
+			}
+			SpyAOT_line(A, "}");
+			break;
+		case OP_VSAVE:
+			SpyAOT_line(A, "{");
+			SpyAOT_line(A, "\tint64_t* p = (int64_t *)&M[s[%lld]];", d - 5);
+			for (int i = 0; i < 4; i++) {
+				SpyAOT_line(A, "\tp[%d] = s[%lld];", i, d - 4 + i);
+			}
+			SpyAOT_line(A, "}");
+			break;
+		case OP_VFADD: case OP_VFSUB: case OP_VFMUL: case OP_VFDIV:
+			for (int i = 0; i < 4; i++) {
+				SpyAOT_line(A, "s[%lld] = spy_bits(spy_float(s[%lld]) %s spy_float(s[%lld]));", d - 8 + i, d - 8 + i, SpyAOT_operator(op), d - 4 + i);
+			}
+			break;
+		case OP_VIADD: case OP_VISUB: case OP_VIMUL:
+			for (int i = 0; i < 4; i++) {
+				SpyAOT_line(A, "s[%lld] = (int64_t)((uint64_t)s[%lld] %s (uint64_t)s[%lld]);", d - 8 + i, d - 8 + i, SpyAOT_operator(op), d - 4 + i);
+			}
+			break;
+		case OP_VFCMP:
+			for (int i = 0; i < 4; i++) {
+				SpyAOT_line(A, "s[%lld] = -(int64_t)(spy_float(s[%lld]) %s spy_float(s[%lld]));", d - 8 + i, d - 8 + i, SpyAOT_comparison(o[0].i), d - 4 + i);
+			}
+			break;
+		case OP_VICMP:
+			for (int i = 0; i < 4; i++) {
+				SpyAOT_line(A, "s[%lld] = -(int64_t)(s[%lld] %s s[%lld]);", d - 8 + i, d - 8 + i, SpyAOT_comparison(o[0].i), d - 4 + i);
+			}
+			break;
+		case OP_VSELECT:
+			for (int i = 0; i < 4; i++) {
+				SpyAOT_line(A, "s[%lld] = (s[%lld] & s[%lld]) | (~s[%lld] & s[%lld]);", d - 12 + i, d - 12 + i, d - 8 + i, d - 12 + i, d - 4 + i);
+			}
+			break;
+		case OP_VSPLAT:
+		{
+			/* the (operand) values above the scalar move up to make room for the lanes */
+			long long at = d - 1 - o[0].i;
+			SpyAOT_line(A, "{");
+			SpyAOT_line(A, "\tint64_t x = s[%lld];", at);
+			for (long long i = d - 1; i > at; i--) {
+				SpyAOT_line(A, "\ts[%lld] = s[%lld];", i + 3, i);
+			}
+			SpyAOT_line(A, "\ts[%lld] = s[%lld] = s[%lld] = s[%lld] = x;", at, at + 1, at + 2, at + 3);
+			SpyAOT_line(A, "}");
+			break;
+		}
+		case OP_VLANE:
+			SpyAOT_line(A, "s[%lld] = s[%lld];", d - 4, d - 4 + o[0].i);
+			break;
+		case OP_FSQRT: case OP_FSIN: case OP_FCOS: case OP_FTAN:
+		case OP_FABS: case OP_FFLOOR: case OP_FCEIL:
+			SpyAOT_line(A, "s[%lld] = spy_bits(%s(spy_float(s[%lld])));", d - 1, SpyAOT_mathFunction(op), d - 1);
+			break;
+		case OP_FMIN: case OP_FMAX:
+			/* a < b ? a : b like the interpreter, not fmin */
+			SpyAOT_line(A, "{");
+			SpyAOT_line(A, "\tdouble x = spy_float(s[%lld]), y = spy_float(s[%lld]);", d - 2, d - 1);
+			SpyAOT_line(A, "\ts[%lld] = spy_bits(x %s y ? x : y);", d - 2, op == OP_FMIN ? "<" : ">");
+			SpyAOT_line(A, "}");
+			break;
+		case OP_FFMA:
+			SpyAOT_line(A, "s[%lld] = spy_bits(fma(spy_float(s[%lld]), spy_float(s[%lld]), spy_float(s[%lld])));", d - 3, d - 3, d - 2, d - 1);
+			break;
+		case OP_IMIN: case OP_IMAX:
+			SpyAOT_line(A, "s[%lld] = s[%lld] %s s[%lld] ? s[%lld] : s[%lld];", d - 2, d - 2, op == OP_IMIN ? "<" : ">", d - 1, d - 2, d - 1);
+			break;
+		case OP_IABS:
+			SpyAOT_line(A, "s[%lld] = s[%lld] < 0 ? (int64_t)(0 - (uint64_t)s[%lld]) : s[%lld];", d - 1, d - 1, d - 1, d - 1);
+			break;
+		default:
+			SpyAOT_fail(A, cell, "has no translation");
+	}
+}
+
+/* the function at (entry), the code at the start of the program runs in
+ * the frame Spy_pushArguments makes, everything else is called
+ */
+static void
+SpyAOT_function(SpyAOT* A, size_t entry) {
+	SpyState* S = A->S;
+	int is_entry = entry == 0;
+	int64_t nargs = is_entry ? 0 : A->nargs[entry];
+
+	SpyAOT_reach(A, entry);
+	int64_t deepest = SpyAOT_measure(A, entry);
+	int in_memory = 0;
+	for (size_t i = 0; i < A->cells; i++) {
+		in_memory |= A->reached[i] && S->code_ops[i] == OP_LEA;
+	}
+
+	fprintf(A->out, "\nstatic int64_t\nspy_%x(SpyState* S", A->offsets[entry]);
+	for (int64_t i = 0; i < nargs; i++) {
+		fprintf(A->out, ", int64_t p%lld", (long long)i);
+	}
+	fprintf(A->out, ") {\n");
+	SpyAOT_line(A, "uint8_t* const M = S->memory;");
+	if (is_entry) {
+		SpyAOT_line(A, "uint8_t* const B = S->bp;");
+	}
+	if (in_memory) {
+		SpyAOT_line(A, "uint8_t* const frame = S->sp;");
+		SpyAOT_line(A, "int64_t* const s = (int64_t *)(frame + 8);");
+		SpyAOT_line(A, "if (frame + %lld >= S->stack_limit) Spy_crash(S, \"stack overflow\");", (long long)deepest*8);
+		SpyAOT_line(A, "S->sp += %lld;", (long long)deepest*8);
+	} else {
+		SpyAOT_line(A, "int64_t s[%lld];", (long long)(deepest > 0 ? deepest : 1));
+	}
+	for (size_t i = 0; i < A->cells; i++) {
+		if (!A->reached[i]) continue;
+		if (A->is_target[i]) {
+			fprintf(A->out, "L%x: ;\n", A->offsets[i]);
+		}
+		SpyAOT_instruction(A, i, is_entry, nargs, in_memory ? "S->sp = frame; " : "");
+	}
+	fprintf(A->out, "}\n");
+}
+
+/* writes (S), which has to be loaded and prepared, as a C program with a
+ * main that runs it from the start
+ */
+void
+SpyAOT_translate(SpyState* S, FILE* out) {
+	SpyAOT translator;
+	SpyAOT* A = &translator;
+	size_t cells = S->code_map[S->bytecode_size] + 1;
+	A->S = S;
+	A->out = out;
+	A->cells = cells;
+	A->offsets = (uint32_t *)malloc(cells * sizeof(uint32_t));
+	A->is_function = (uint8_t *)calloc(cells, 1);
+	A->results = (uint8_t *)calloc(cells, 1);
+	A->nargs = (int64_t *)malloc(cells * sizeof(int64_t));
+	A->reached = (uint8_t *)malloc(cells);
+	A->is_target = (uint8_t *)malloc(cells);
+	A->depth = (int64_t *)malloc(cells * sizeof(int64_t));
+	A->work = (uint32_t *)malloc(cells * sizeof(uint32_t));
+	if (!A->offsets || !A->is_function || !A->results || !A->nargs || !A->reached || !A->is_target || !A->depth || !A->work) {
+		Spy_crash(S, "couldn't allocate memory to translate '%s'", S->filename);
+	}
+	for (size_t at = 0; at <= S->bytecode_size; at++) {
+		if (S->code_map[at] != SPY_NOCELL) {
+			A->offsets[S->code_map[at]] = at;
+		}
+	}
+
+	/* functions are call targets, each always called with the same arguments */
+	for (size_t i = 0; i < cells; i++) {
+		A->nargs[i] = -1;
+	}
+	for (size_t i = 0; i < cells; i++) {
+		if (S->code_ops[i] != OP_CALL && S->code_ops[i] != OP_TAILCALL) continue;
+		size_t target = S->code[i + 1].target - S->code;
+		if (target == 0) {
+			SpyAOT_fail(A, i, "calls the start of the code");
+		}
+		if (A->nargs[target] >= 0 && A->nargs[target] != S->code[i + 2].i) {
+			SpyAOT_fail(A, i, "passes a different number of arguments than other calls to the function");
+		}
+		A->is_function[target] = 1;
+		A->nargs[target] = S->code[i + 2].i;
+	}
+
+	/* a function returns a value if it can reach iret, or tail call one that does */
+	for (int changed = 1; changed;) {
+		changed = 0;
+		for (size_t f = 0; f < cells; f++) {
+			if (!A->is_function[f] || A->results[f]) continue;
+			SpyAOT_reach(A, f);
+			for (size_t i = 0; i < cells && !A->results[f]; i++) {
+				if (!A->reached[i]) continue;
+				uint8_t op = S->code_ops[i];
+				A->results[f] = op == OP_IRET || op == OP_FRET || (op == OP_TAILCALL && A->results[S->code[i + 1].target - S->code]);
+			}
+			changed |= A->results[f];
+		}
+	}
+
+	fprintf(out, "/* %s, translated by spy n */\n", S->filename);
+	fprintf(out, "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n#include <math.h>\n#include \"spyre.h\"\n\n");
+	fprintf(out, "static inline double\nspy_float(int64_t bits) {\n\tdouble value;\n\tmemcpy(&value, &bits, sizeof(value));\n\treturn value;\n}\n\n");
+	fprintf(out, "static inline int64_t\nspy_bits(double value) {\n\tint64_t bits;\n\tmemcpy(&bits, &value, sizeof(bits));\n\treturn bits;\n}\n\n");
+	fprintf(out, "static uint8_t*\nspy_block(SpyState* S, int64_t address, int64_t size) {\n");
+	fprintf(out, "\tif (size < 0 || address < 0 || (uint64_t)size > S->size_memory || (uint64_t)address > S->size_memory - size) {\n");
+	fprintf(out, "\t\tSpy_crash(S, \"block of %%lld bytes at 0x%%llx is outside memory\", size, address);\n\t}\n");
+	fprintf(out, "\treturn &S->memory[address];\n}\n\n");
+	fprintf(out, "typedef uint32_t (*spy_cfunction)(SpyState*);\n\n");
+	fprintf(out, "static spy_cfunction\nspy_bind(SpyState* S, const char* identifier) {\n");
+	fprintf(out, "\tint64_t index = Spy_findC(S, identifier);\n");
+	fprintf(out, "\tif (index < 0) Spy_crash(S, \"undefined C function '%%s'\", identifier);\n");
+	fprintf(out, "\treturn S->c_table[index];\n}\n\n");
+
+	/* ROM */
+	fprintf(out, "static const uint8_t spy_rom[%zu] = {", S->rom_size > 0 ? S->rom_size : 1);
+	for (size_t i = 0; i < S->rom_size; i++) {
+		fprintf(out, "%s0x%02x,", i % 16 ? " " : "\n\t", S->memory[i]);
+	}
+	fprintf(out, "\n};\n\n");
+
+	/* C functions called, bound when the program starts */
+	uint8_t* used = (uint8_t *)calloc(S->c_count + 1, 1);
+	for (size_t i = 0; i < cells; i++) {
+		if (S->code_ops[i] == OP_CCALL) {
+			used[S->code[i + 1].i] = 1;
+		}
+	}
+	for (uint32_t i = 0; i < S->c_count; i++) {
+		if (used[i]) {
+			fprintf(out, "static spy_cfunction spy_c%u;\n", i);
+		}
+	}
+
+	for (size_t i = 0; i < cells; i++) {
+		if (A->is_function[i]) {
+			fprintf(out, "static int64_t spy_%x(SpyState*", A->offsets[i]);
+			for (int64_t k = 0; k < A->nargs[i]; k++) {
+				fprintf(out, ", int64_t");
+			}
+			fprintf(out, ");\n");
+		}
+	}
+	SpyAOT_function(A, 0);
+	for (size_t i = 0; i < cells; i++) {
+		if (A->is_function[i]) {
+			SpyAOT_function(A, i);
+		}
+	}
+
+	fprintf(out, "\nint\nmain(int argc, char** argv) {\n");
+	fprintf(out, "\tSpyState* S = Spy_newState(SPY_NOFLAG);\n");
+	fprintf(out, "\tSpy_loadROM(S, spy_rom, %zu, \"", S->rom_size);
+	for (const char* c = S->filename; *c; c++) {
+		fprintf(out, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+	}
+	fprintf(out, "\");\n");
+	uint32_t index = 0;
+	for (SpyCFunction* at = S->c_functions; at; at = at->next, index++) {
+		if (!used[index]) continue;
+		fprintf(out, "\tspy_c%u = spy_bind(S, \"", index);
+		for (const char* c = at->identifier; *c; c++) {
+			fprintf(out, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+		}
+		fprintf(out, "\");\n");
+	}
+	fprintf(out, "\tSpy_pushArguments(S, argc, argv);\n");
+	fprintf(out, "\tspy_0(S);\n");
+	fprintf(out, "\tSpy_freeState(S);\n");
+	fprintf(out, "\treturn 0;\n}\n");
+
+	free(used);
+	free(A->offsets);
+	free(A->is_function);
+	free(A->results);
+	free(A->nargs);
+	free(A->reached);
+	free(A->is_target);
+	free(A->depth);
+	free(A->work);
+}
+
+/* translates the bytecode file (input) to (output).c and builds it into
+ * the executable (output) with the runtime
+ */
+void
+SpyAOT_compile(const char* input, const char* output) {
+	SpyState* S = Spy_newState(SPY_NOFLAG);
+	Spy_load(S, input);
+	Spy_prepare(S);
+
+	size_t length = strlen(output);
+	char* source = (char *)malloc(length + 3);
+	sprintf(source, "%s.c", output);
+	FILE* f = fopen(source, "w");
+	if (!f) {
+		Spy_crash(S, "couldn't write '%s'", source);
+	}
+	SpyAOT_translate(S, f);
+	fclose(f);
+
+	const char* home = getenv("SPYRE_HOME");
+	const char* cc = getenv("SPYRE_CC");
+	if (!home) home = SPY_HOME;
+	if (!cc) cc = SPY_AOT_CC;
+	size_t size = strlen(cc) + strlen(home)*2 + length*2 + 128;
+	char* command = (char *)malloc(size);
+	snprintf(command, size, "%s %s -I\"%s\" \"%s\" \"%s/build/libspy.a\" -o \"%s\" -lm -pthread", cc, SPY_AOT_FLAGS, home, source, home, output);
+	if (system(command)) {
+		Spy_crash(S, "couldn't build '%s' (%s)", output, command);
+	}
+	free(command);
+	free(source);
+	Spy_freeState(S);
+}
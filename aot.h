@@ -0,0 +1,21 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stdio.h>
+#include "spyre.h"
+
+/* where the runtime's headers and build/libspy.a are, the SPYRE_HOME
+ * environment variable overrides it
+ */
+#ifndef SPY_HOME
+#define SPY_HOME	"."
+#endif
+
+/* compiler the translated program is built with, SPYRE_CC overrides it */
+#define SPY_AOT_CC		"gcc"
+#define SPY_AOT_FLAGS	"-std=c99 -O2 -w"
+
+void	SpyAOT_translate(SpyState*, FILE*);
+void	SpyAOT_compile(const char*, const char*);
+
+#endif
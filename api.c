@@ -21,6 +21,7 @@ void SpyL_initializeStandardLibrary(SpyState* S) {
 	Spy_pushC(S, "malloc", SpyL_malloc);
 	Spy_pushC(S, "free", SpyL_free);
 	Spy_pushC(S, "exit", SpyL_exit);
+	Spy_pushC(S, "snapshot", SpyL_snapshot);
 
 	Spy_pushC(S, "min", SpyL_min);
 	Spy_pushC(S, "max", SpyL_max);
@@ -28,6 +29,13 @@ void SpyL_initializeStandardLibrary(SpyState* S) {
 	Spy_pushC(S, "sin", SpyL_sin);
 	Spy_pushC(S, "cos", SpyL_cos);
 	Spy_pushC(S, "tan", SpyL_tan);
+	Spy_pushC(S, "fabs", SpyL_fabs);
+	Spy_pushC(S, "floor", SpyL_floor);
+	Spy_pushC(S, "ceil", SpyL_ceil);
+	Spy_pushC(S, "fmin", SpyL_fmin);
+	Spy_pushC(S, "fmax", SpyL_fmax);
+	Spy_pushC(S, "fma", SpyL_fma);
+	Spy_pushC(S, "abs", SpyL_abs);
 }
 
 static uint32_t
@@ -54,6 +62,62 @@ SpyL_tan(SpyState* S) {
 	return 1;
 }
 
+/* the compiler emits instructions for these (and the ones above), they're
+ * here for declarations whose types don't match the instruction
+ */
+static uint32_t
+SpyL_fabs(SpyState* S) {
+	Spy_pushFloat(S, fabs(Spy_popFloat(S)));
+	return 1;
+}
+
+static uint32_t
+SpyL_floor(SpyState* S) {
+	Spy_pushFloat(S, floor(Spy_popFloat(S)));
+	return 1;
+}
+
+static uint32_t
+SpyL_ceil(SpyState* S) {
+	Spy_pushFloat(S, ceil(Spy_popFloat(S)));
+	return 1;
+}
+
+static uint32_t
+SpyL_fmin(SpyState* S) {
+	double a, b;
+	a = Spy_popFloat(S);
+	b = Spy_popFloat(S);
+	Spy_pushFloat(S, a < b ? a : b);
+	return 1;
+}
+
+static uint32_t
+SpyL_fmax(SpyState* S) {
+	double a, b;
+	a = Spy_popFloat(S);
+	b = Spy_popFloat(S);
+	Spy_pushFloat(S, a > b ? a : b);
+	return 1;
+}
+
+static uint32_t
+SpyL_fma(SpyState* S) {
+	double a, b, c;
+	a = Spy_popFloat(S);
+	b = Spy_popFloat(S);
+	c = Spy_popFloat(S);
+	Spy_pushFloat(S, fma(a, b, c));
+	return 1;
+}
+
+static uint32_t
+SpyL_abs(SpyState* S) {
+	int64_t a = Spy_popInt(S);
+	Spy_pushInt(S, a < 0 ? -a : a);
+	return 1;
+}
+
 static uint32_t
 SpyL_println(SpyState* S) {
 	SpyL_print(S);
@@ -203,8 +267,8 @@ SpyL_malloc(SpyState* S) {
 		S->memory_chunks = chunk;
 		chunk->next = NULL;
 		chunk->prev = NULL;
-		chunk->absolute_address = &S->memory[START_HEAP];
-		chunk->vm_address = START_HEAP;
+		chunk->absolute_address = &S->memory[S->start_heap];
+		chunk->vm_address = S->start_heap;
 	} else {
 		SpyMemoryChunk* at = S->memory_chunks;
 		uint8_t found_slot = 0;
@@ -233,12 +297,25 @@ SpyL_malloc(SpyState* S) {
 		}
 	}
 
-	Spy_pushInt(S, chunk->vm_address <= (START_HEAP + SIZE_MEMORY) ? chunk->vm_address : 0);
+	/* out of heap, only a chunk at the end can be */
+	if (chunk->vm_address + chunk->pages * SIZE_PAGE > S->size_memory) {
+		if (chunk->prev) {
+			chunk->prev->next = NULL;
+		} else {
+			S->memory_chunks = NULL;
+		}
+		free(chunk);
+		Spy_pushInt(S, 0);
+		return 0;
+	}
+	Spy_growHeap(S, chunk->vm_address + chunk->pages * SIZE_PAGE);
+
+	Spy_pushInt(S, chunk->vm_address);
 
 	return 0;
 }
 
-static uint32_t
+uint32_t
 SpyL_free(SpyState* S) {
 	static const char* errmsg = "Attempt to free an invalid pointer (0x%x)";
 	uint8_t success = 0;
@@ -270,6 +347,14 @@ SpyL_exit(SpyState* S) {
 	return 0;
 }
 
+/* snapshot(path) -> 0, or 1 when resumed from the snapshot */
+static uint32_t
+SpyL_snapshot(SpyState* S) {
+	Spy_snapshot(S, Spy_popString(S));
+	Spy_pushInt(S, 0);
+	return 1;
+}
+
 static uint32_t
 SpyL_min(SpyState* S) {
 	int64_t a, b;
@@ -23,8 +23,9 @@ static uint32_t SpyL_fseek(SpyState*);
 
 /* memory management */
 uint32_t		SpyL_malloc(SpyState*); /* expose to spyre.c */
-static uint32_t SpyL_free(SpyState*);
+uint32_t		SpyL_free(SpyState*); /* expose to spyre.c */
 static uint32_t	SpyL_exit(SpyState*);
+static uint32_t	SpyL_snapshot(SpyState*);
 
 /* math */
 static uint32_t SpyL_max(SpyState*);
@@ -34,5 +35,12 @@ static uint32_t SpyL_sqrt(SpyState*);
 static uint32_t SpyL_sin(SpyState*);
 static uint32_t SpyL_cos(SpyState*);
 static uint32_t SpyL_tan(SpyState*);
+static uint32_t SpyL_fabs(SpyState*);
+static uint32_t SpyL_floor(SpyState*);
+static uint32_t SpyL_ceil(SpyState*);
+static uint32_t SpyL_fmin(SpyState*);
+static uint32_t SpyL_fmax(SpyState*);
+static uint32_t SpyL_fma(SpyState*);
+static uint32_t SpyL_abs(SpyState*);
 
 #endif
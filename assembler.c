@@ -3,6 +3,7 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include "assembler.h"
+#include "spyre.h"
 
 const AssemblerInstruction instructions[0xFF] = {
 	{"NOOP",	0x00, {NO_OPERAND}},
@@ -24,12 +25,12 @@ const AssemblerInstruction instructions[0xFF] = {
 	{"ILT",		0x10, {NO_OPERAND}},
 	{"ILE",		0x11, {NO_OPERAND}},
 	{"ICMP",	0x12, {NO_OPERAND}},
-	{"JNZ",		0x13, {_INT32}},
-	{"JZ",		0x14, {_INT32}},
-	{"JMP",		0x15, {_INT32}},
-	{"CALL",	0x16, {_INT32, _INT32}},
+	{"JNZ",		0x13, {_LABEL}},
+	{"JZ",		0x14, {_LABEL}},
+	{"JMP",		0x15, {_LABEL}},
+	{"CALL",	0x16, {_LABEL, _INT32}},
 	{"IRET",	0x17, {NO_OPERAND}},
-	{"CCALL",	0x18, {_INT32, _INT32}},
+	{"CCALL",	0x18, {_INT32, _INT32, _INT32}},
 	{"FPUSH",	0x19, {_FLOAT64}},
 	{"FADD",	0x1A, {NO_OPERAND}},
 	{"FSUB",	0x1B, {NO_OPERAND}},
@@ -41,13 +42,13 @@ const AssemblerInstruction instructions[0xFF] = {
 	{"FLE",		0x21, {NO_OPERAND}},
 	{"FCMP",	0x22, {NO_OPERAND}},
 	{"FRET",	0x23, {NO_OPERAND}},
-	{"ILLOAD",	0x24, {_INT32}},
-	{"ILSAVE",	0x25, {_INT32}},
+	{"ILLOAD",	0x24, {_SLOT}},
+	{"ILSAVE",	0x25, {_SLOT}},
 	{"IARG",	0x26, {_INT32}},
 	{"ILOAD",	0x27, {NO_OPERAND}},
 	{"ISAVE",	0x28, {NO_OPERAND}},
 	{"RES",		0x29, {_INT32}},
-	{"LEA",		0x2A, {_INT32}},
+	{"LEA",		0x2A, {_SLOT}},
 	{"IDER",	0x2B, {NO_OPERAND}},
 	{"ICINC",	0x2C, {_INT64}},
 	{"CDER",	0x2D, {NO_OPERAND}},
@@ -63,15 +64,99 @@ const AssemblerInstruction instructions[0xFF] = {
 	{"CJNZ",	0x37, {NO_OPERAND}},
 	{"CJZ",		0x38, {NO_OPERAND}},
 	{"CJMP",	0x39, {NO_OPERAND}},
-	{"ILNSAVE",	0x3A, {_INT32, _INT32}},
-	{"ILNLOAD",	0x3B, {_INT32, _INT32}},
-	{"FLLOAD",	0x3C, {_INT32}},
-	{"FLSAVE",	0x3D, {_INT32}},
+	{"ILNSAVE",	0x3A, {_SLOT, _INT32}},
+	{"ILNLOAD",	0x3B, {_SLOT, _INT32}},
+	{"FLLOAD",	0x3C, {_SLOT}},
+	{"FLSAVE",	0x3D, {_SLOT}},
 	{"FTOI",	0x3E, {_INT32}},
 	{"ITOF",	0x3F, {_INT32}},
 	{"FDER",	0x40, {NO_OPERAND}},
 	{"FSAVE",	0x41, {NO_OPERAND}},
-	{"LNOT",	0x42, {NO_OPERAND}}
+	{"LNOT",	0x42, {NO_OPERAND}},
+	{"RISET",	0x43, {_SLOT, _INT64}},
+	{"RFSET",	0x44, {_SLOT, _FLOAT64}},
+	{"RMOV",	0x45, {_SLOT, _SLOT}},
+	{"RIADD",	0x46, {_SLOT, _SLOT, _SLOT}},
+	{"RISUB",	0x47, {_SLOT, _SLOT, _SLOT}},
+	{"RIMUL",	0x48, {_SLOT, _SLOT, _SLOT}},
+	{"RIDIV",	0x49, {_SLOT, _SLOT, _SLOT}},
+	{"RFADD",	0x4A, {_SLOT, _SLOT, _SLOT}},
+	{"RFSUB",	0x4B, {_SLOT, _SLOT, _SLOT}},
+	{"RFMUL",	0x4C, {_SLOT, _SLOT, _SLOT}},
+	{"RFDIV",	0x4D, {_SLOT, _SLOT, _SLOT}},
+	{"ILLADD",	0x4E, {_SLOT, _SLOT}},
+	{"FLLADD",	0x4F, {_SLOT, _SLOT}},
+	{"FLLSUB",	0x50, {_SLOT, _SLOT}},
+	{"FLLMUL",	0x51, {_SLOT, _SLOT}},
+	{"ILINC",	0x52, {_SLOT, _INT64}},
+	{"ILFIELD",	0x53, {_SLOT, _INT64}},
+	{"FLFIELD",	0x54, {_SLOT, _INT64}},
+	{"ICIDER",	0x55, {_INT64}},
+	{"ICFDER",	0x56, {_INT64}},
+	{"RIADDI",	0x57, {_SLOT, _INT64, _SLOT, _SLOT}},
+	{"ILTJZ",	0x58, {_LABEL}},
+	{"ILEJZ",	0x59, {_LABEL}},
+	{"ICMPJZ",	0x5A, {_LABEL}},
+	{"ENTER",	0x5B, {_INT32, _INT32}},
+	{"COCREATE",	0x5C, {_LABEL, _INT32, _INT32}},
+	{"RESUME",	0x5D, {NO_OPERAND}},
+	{"YIELD",	0x5E, {NO_OPERAND}},
+	{"COSTATUS",	0x5F, {NO_OPERAND}},
+	{"TAILCALL",	0x60, {_LABEL, _INT32}},
+	{"MEMCPY",	0x61, {NO_OPERAND}},
+	{"MEMSET",	0x62, {NO_OPERAND}},
+	{"MEMMOVE",	0x63, {NO_OPERAND}},
+	{"VLLOAD",	0x64, {_SLOT}},
+	{"VLSAVE",	0x65, {_SLOT}},
+	{"VLOAD",	0x66, {NO_OPERAND}},
+	{"VSAVE",	0x67, {NO_OPERAND}},
+	{"VFADD",	0x68, {NO_OPERAND}},
+	{"VFSUB",	0x69, {NO_OPERAND}},
+	{"VFMUL",	0x6A, {NO_OPERAND}},
+	{"VFDIV",	0x6B, {NO_OPERAND}},
+	{"VIADD",	0x6C, {NO_OPERAND}},
+	{"VISUB",	0x6D, {NO_OPERAND}},
+	{"VIMUL",	0x6E, {NO_OPERAND}},
+	{"VFCMP",	0x6F, {_INT32}},
+	{"VICMP",	0x70, {_INT32}},
+	{"VSELECT",	0x71, {NO_OPERAND}},
+	{"VSPLAT",	0x72, {_INT32}},
+	{"VLANE",	0x73, {_INT32}},
+	{"FSQRT",	0x74, {NO_OPERAND}},
+	{"FSIN",	0x75, {NO_OPERAND}},
+	{"FCOS",	0x76, {NO_OPERAND}},
+	{"FTAN",	0x77, {NO_OPERAND}},
+	{"FABS",	0x78, {NO_OPERAND}},
+	{"FFLOOR",	0x79, {NO_OPERAND}},
+	{"FCEIL",	0x7A, {NO_OPERAND}},
+	{"FMIN",	0x7B, {NO_OPERAND}},
+	{"FMAX",	0x7C, {NO_OPERAND}},
+	{"FFMA",	0x7D, {NO_OPERAND}},
+	{"IMIN",	0x7E, {NO_OPERAND}},
+	{"IMAX",	0x7F, {NO_OPERAND}},
+	{"IABS",	0x80, {NO_OPERAND}}
+};
+
+/* superinstructions, picked from opcode pair counts of the demos.
+ * longer sequences must come first so they win over their prefixes
+ */
+static const AssemblerFusion fusions[] = {
+	{{"ILLOAD", "ILLOAD", "IADD"},	"ILLADD",	0},
+	{{"FLLOAD", "FLLOAD", "FADD"},	"FLLADD",	0},
+	{{"FLLOAD", "FLLOAD", "FSUB"},	"FLLSUB",	0},
+	{{"FLLOAD", "FLLOAD", "FMUL"},	"FLLMUL",	0},
+	{{"ILLOAD", "ICINC", "IDER"},	"ILFIELD",	0},
+	{{"ILLOAD", "ICINC", "FDER"},	"FLFIELD",	0},
+	{{"ILLOAD", "ICINC"},			"ILINC",	0},
+	{{"ICINC", "IDER"},				"ICIDER",	0},
+	{{"ICINC", "FDER"},				"ICFDER",	0},
+	/* riset t, k; riadd d, a, t -> riaddi t, k, d, a */
+	{{"RISET", "RIADD"},			"RIADDI",	4},
+	{{"RISET", "RIADD"},			"RIADDI",	3},
+	{{"ILT", "JZ"},					"ILTJZ",	0},
+	{{"ILE", "JZ"},					"ILEJZ",	0},
+	{{"ICMP", "JZ"},				"ICMPJZ",	0},
+	{{NULL}}
 };
 
 void
@@ -124,6 +209,14 @@ Assembler_generateBytecodeFile(const char* in_file_name) {
 	
 	if (!(A.tokens = head = AsmLexer_convertToAssemblerTokens(input.contents))) goto done;
 
+	/* pass zero, replace common sequences with superinstructions
+	 * and give functions with a known stack depth a checked prologue
+	 */
+	Assembler_fuseInstructions(&A);
+	A.tokens = head;
+	Assembler_analyzeFrames(&A);
+	A.tokens = head;
+
 	/* pass one, find all labels */
 	while (A.tokens && A.tokens->next) {
 		if (A.tokens->type == IDENTIFIER) {
@@ -166,6 +259,8 @@ Assembler_generateBytecodeFile(const char* in_file_name) {
 					index += (
 						ins->operands[i] == _INT64 ? 8 :
 						ins->operands[i] == _INT32 ? 4 : 
+						ins->operands[i] == _SLOT ? 4 :
+						ins->operands[i] == _LABEL ? 4 :
 						ins->operands[i] == _FLOAT64 ? 8 : 0
 					);
 				}
@@ -241,6 +336,8 @@ Assembler_generateBytecodeFile(const char* in_file_name) {
 							break;
 						}
 						case _INT32:
+						case _SLOT:
+						case _LABEL:
 						{
 							uint64_t n = A.tokens->word[1] == 'x' ? strtoll(&A.tokens->word[2], NULL, 16) : strtol(A.tokens->word, NULL, 10);
 							fwrite(&n, 1, 4, tmp_output.handle);
@@ -277,15 +374,20 @@ Assembler_generateBytecodeFile(const char* in_file_name) {
 	tmp_input.contents = NULL;
 
 	/* write the headers for the output file */
-	const uint32_t magic = 0x5950535F;
-	const uint32_t rom = sizeof(uint32_t) * 2;
-	const uint32_t code = sizeof(uint32_t) * 3 + rom_size;
+	const uint32_t magic = SPY_MAGIC;
+	const uint32_t rom = ROM_ALIGN;
+	const uint32_t code = ROM_ALIGN + rom_size;
+	const uint32_t format = SPY_FORMAT;
 	fwrite(&magic, sizeof(uint32_t), 1, output.handle);
 	fwrite(&rom, sizeof(uint32_t), 1, output.handle);
 	fwrite(&code, sizeof(uint32_t), 1, output.handle);
+	fwrite(&format, sizeof(uint32_t), 1, output.handle);
+	for (uint32_t i = SIZE_HEADER; i < ROM_ALIGN; i++) {
+		fputc(0, output.handle);
+	}
 
 	/* copy temporary file into output file */
-	char c;
+	int c;
 	while ((c = fgetc(tmp_input.handle)) != EOF) {
 		fputc(c, output.handle);
 	}
@@ -350,10 +452,295 @@ Assembler_appendConstant(Assembler* A, const char* identifier, uint32_t index) {
 	}
 }
 
+/* returns the token after the operands of instruction (at), skips commas */
+static AssemblerToken*
+Assembler_skipOperands(Assembler* A, AssemblerToken* at, const AssemblerInstruction* ins) {
+	for (int i = 0; i < 4 && at; i++) {
+		if (ins->operands[i] == NO_OPERAND) break;
+		at = at->next;
+		if (at && at->word[0] == ',') {
+			at = at->next;
+		}
+	}
+	return at ? at->next : NULL;
+}
+
+static void
+Assembler_fuseInstructions(Assembler* A) {
+	for (AssemblerToken* at = A->tokens; at; at = at->next) {
+		const AssemblerInstruction* ins;
+		if (at->type != IDENTIFIER || !(ins = Assembler_validateInstruction(A, at->word))) {
+			continue;
+		}
+		for (const AssemblerFusion* f = fusions; f->fused; f++) {
+			AssemblerToken* operands[16];
+			AssemblerToken* scan = at;
+			AssemblerToken* end;
+			int noperands = 0;
+			int length = 0;
+			/* the instructions must follow each other directly, a label 
+			 * between them means something can jump into the middle 
+			 */
+			while (length < 4 && f->sequence[length]) {
+				const AssemblerInstruction* next;
+				if (!scan || scan->type != IDENTIFIER || strcmp_lower(scan->word, f->sequence[length])) break;
+				next = Assembler_validateInstruction(A, scan->word);
+				end = scan;
+				for (int i = 0; i < 4 && next->operands[i] != NO_OPERAND; i++) {
+					end = end->next;
+					if (end && end->word[0] == ',') end = end->next;
+					if (!end) break;
+					operands[noperands++] = end;
+				}
+				scan = Assembler_skipOperands(A, scan, next);
+				length++;
+			}
+			if (length < 4 && f->sequence[length]) continue;
+			if (f->same && (noperands <= f->same || strcmp(operands[0]->word, operands[f->same]->word))) continue;
+			/* found, free everything in between that won't be reused... */
+			for (AssemblerToken* i = at->next; i && i != scan; ) {
+				AssemblerToken* next = i->next;
+				int reused = 0;
+				for (int j = 0; j < noperands; j++) {
+					if (operands[j] == i && !(f->same && j == f->same)) reused = 1;
+				}
+				if (!reused) {
+					free(i->word);
+					free(i);
+				}
+				i = next;
+			}
+			/* ...and rewrite as one instruction followed by its operands */
+			AssemblerToken* last = at;
+			free(at->word);
+			at->word = (char *)malloc(strlen(f->fused) + 1);
+			strcpy(at->word, f->fused);
+			for (int i = 0; i < noperands; i++) {
+				if (f->same && i == f->same) continue;
+				last->next = operands[i];
+				operands[i]->prev = last;
+				last = operands[i];
+			}
+			last->next = scan;
+			if (scan) scan->prev = last;
+			break;
+		}
+	}
+}
+
+/* stack effect of one instruction in slots, from Spy_instructionEffect,
+ * (results) is what the target of a call leaves on the stack
+ * RETURN:
+ *	1 -> *delta is set, and *peak to the highest it goes while running
+ *	0 -> can't be known (computed jumps)
+ */
+static int
+Assembler_stackEffect(const AssemblerInstruction* ins, AssemblerToken** operands, int results, int* delta, int* peak) {
+	SpyCell values[4] = {{0}};
+	int64_t pops, pushes;
+	if (ins->opcode == OP_CJNZ || ins->opcode == OP_CJZ || ins->opcode == OP_CJMP) {
+		return 0;
+	}
+	for (int i = 0; i < 4 && ins->operands[i] != NO_OPERAND; i++) {
+		values[i].i = strtol(operands[i]->word, NULL, 0);
+	}
+	Spy_instructionEffect(ins->opcode, values, results, &pops, &pushes);
+	*delta = pushes - pops;
+	*peak = 0;
+	if (ins->opcode == OP_CALL) {
+		/* nargs, bp and ip go on top of the arguments */
+		*peak = 3;
+	} else if (ins->opcode == OP_CCALL) {
+		*peak = CCALL_DEPTH;
+	}
+	if (*delta > *peak) {
+		*peak = *delta;
+	}
+	return 1;
+}
+
+/* index of the instruction label (name) points to, -1 if it doesn't exist */
+static int
+Assembler_findLabel(const char** names, const int* indices, int count, const char* name) {
+	for (int i = 0; i < count; i++) {
+		if (!strcmp(names[i], name)) {
+			return indices[i];
+		}
+	}
+	return -1;
+}
+
+/* finds the deepest the stack gets in each function (anything called), 
+ * the res that starts it is turned into enter, which checks once per call
+ * that the whole frame fits.  functions with computed jumps, or that keep
+ * growing the stack in a loop, keep their res
+ */
+static void
+Assembler_analyzeFrames(Assembler* A) {
+	const AssemblerInstruction* ins;
+	int count = 0;
+	int nlabels = 0;
+
+	/* count instructions and labels */
+	for (AssemblerToken* t = A->tokens; t;) {
+		if (t->type == IDENTIFIER && !strcmp_lower(t->word, "let")) {
+			t = t->next && t->next->next ? t->next->next->next : NULL;
+		} else if (t->type == IDENTIFIER && t->next && t->next->word[0] == ':') {
+			nlabels++;
+			t = t->next->next;
+		} else if (t->type == IDENTIFIER && (ins = Assembler_validateInstruction(A, t->word))) {
+			count++;
+			t = Assembler_skipOperands(A, t, ins);
+		} else {
+			t = t->next;
+		}
+	}
+	if (count == 0) return;
+
+	AssemblerToken** at = (AssemblerToken **)malloc(count * sizeof(AssemblerToken *));
+	AssemblerToken** operands = (AssemblerToken **)calloc(count * 4, sizeof(AssemblerToken *));
+	const AssemblerInstruction** code = (const AssemblerInstruction **)malloc(count * sizeof(AssemblerInstruction *));
+	const char** label_names = (const char **)malloc((nlabels + 1) * sizeof(char *));
+	int* label_indices = (int *)malloc((nlabels + 1) * sizeof(int));
+	int* depth = (int *)malloc(count * sizeof(int));
+	int* work = (int *)malloc(count * sizeof(int));
+	uint8_t* queued = (uint8_t *)malloc(count);
+	uint8_t* is_function = (uint8_t *)calloc(count, 1);
+	int n = 0;
+	nlabels = 0;
+
+	for (AssemblerToken* t = A->tokens; t;) {
+		if (t->type == IDENTIFIER && !strcmp_lower(t->word, "let")) {
+			t = t->next && t->next->next ? t->next->next->next : NULL;
+		} else if (t->type == IDENTIFIER && t->next && t->next->word[0] == ':') {
+			label_names[nlabels] = t->word;
+			label_indices[nlabels++] = n;
+			t = t->next->next;
+		} else if (t->type == IDENTIFIER && (ins = Assembler_validateInstruction(A, t->word))) {
+			AssemblerToken* o = t;
+			at[n] = t;
+			code[n] = ins;
+			for (int i = 0; i < 4 && ins->operands[i] != NO_OPERAND; i++) {
+				o = o ? o->next : NULL;
+				if (o && o->word[0] == ',') o = o->next;
+				if (!o) goto done; /* pass three reports it */
+				operands[n*4 + i] = o;
+			}
+			n++;
+			t = Assembler_skipOperands(A, t, ins);
+		} else {
+			t = t->next;
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (code[i]->opcode == OP_CALL || code[i]->opcode == OP_COCREATE || code[i]->opcode == OP_TAILCALL) {
+			int target = Assembler_findLabel(label_names, label_indices, nlabels, operands[i*4]->word);
+			if (target >= 0 && target < count) is_function[target] = 1;
+		}
+	}
+
+	for (int entry = 0; entry < count; entry++) {
+		int max = 0;
+		int verifiable = 1;
+		int nwork = 0;
+		if (!is_function[entry] || code[entry]->opcode != OP_RES) continue;
+		for (int i = 0; i < count; i++) {
+			depth[i] = -1;
+			queued[i] = 0;
+		}
+		depth[entry] = 0;
+		work[nwork++] = entry;
+		queued[entry] = 1;
+		while (nwork > 0 && verifiable) {
+			int k = work[--nwork];
+			int results = 0;
+			int delta, peak;
+			int next[2];
+			int nnext = 0;
+			uint8_t op = code[k]->opcode;
+			queued[k] = 0;
+			if (op == OP_CALL) {
+				/* the callee returns a value if it has an iret or fret, a tail
+				 * call might, which only overestimates the depth
+				 */
+				int callee = Assembler_findLabel(label_names, label_indices, nlabels, operands[k*4]->word);
+				for (int i = callee; i >= 0 && i < count && (i == callee || !is_function[i]); i++) {
+					if (code[i]->opcode == OP_IRET || code[i]->opcode == OP_FRET || code[i]->opcode == OP_TAILCALL) {
+						results = 1;
+						break;
+					}
+				}
+			}
+			if (!Assembler_stackEffect(code[k], &operands[k*4], results, &delta, &peak)) {
+				verifiable = 0;
+				break;
+			}
+			if (depth[k] + peak > max) {
+				max = depth[k] + peak;
+			}
+			switch (op) {
+				case OP_JMP:
+					next[nnext++] = Assembler_findLabel(label_names, label_indices, nlabels, operands[k*4]->word);
+					break;
+				case OP_JZ: case OP_JNZ: case OP_ILTJZ: case OP_ILEJZ: case OP_ICMPJZ:
+					next[nnext++] = k + 1;
+					next[nnext++] = Assembler_findLabel(label_names, label_indices, nlabels, operands[k*4]->word);
+					break;
+				case OP_IRET: case OP_VRET: case OP_FRET: case OP_NOOP:
+				case OP_TAILCALL:
+					break;
+				default:
+					next[nnext++] = k + 1;
+					break;
+			}
+			/* paths that meet keep the deeper stack */
+			for (int i = 0; i < nnext; i++) {
+				int s = next[i];
+				if (s < 0 || s >= count || depth[s] >= depth[k] + delta) continue;
+				depth[s] = depth[k] + delta;
+				if (depth[s] > MAX_FRAME_DEPTH) {
+					verifiable = 0;
+				} else if (!queued[s]) {
+					queued[s] = 1;
+					work[nwork++] = s;
+				}
+			}
+		}
+		if (!verifiable) continue;
+
+		/* res n -> enter n, (depth above the locals) */
+		AssemblerToken* slots = operands[entry*4];
+		AssemblerToken* extra = (AssemblerToken *)malloc(sizeof(AssemblerToken));
+		free(at[entry]->word);
+		at[entry]->word = (char *)malloc(8);
+		strcpy(at[entry]->word, "enter");
+		extra->word = (char *)malloc(16);
+		sprintf(extra->word, "%ld", max - strtol(slots->word, NULL, 0));
+		extra->line = slots->line;
+		extra->type = NUMBER;
+		extra->prev = slots;
+		extra->next = slots->next;
+		if (slots->next) slots->next->prev = extra;
+		slots->next = extra;
+	}
+
+	done:
+	free(at);
+	free(operands);
+	free(code);
+	free(label_names);
+	free(label_indices);
+	free(depth);
+	free(work);
+	free(queued);
+	free(is_function);
+}
+
 /* 0 = not valid, 1 = valid */
 static const AssemblerInstruction*
 Assembler_validateInstruction(Assembler* A, const char* instruction) {
-	for (int i = 0; i <= 0x42; i++) {
+	for (int i = 0; instructions[i].name; i++) {
 		if (!strcmp_lower(instructions[i].name, instruction)) {
 			return &instructions[i];	
 		};
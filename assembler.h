@@ -6,19 +6,162 @@
 #include "assembler_lex.h"
 
 #define TMPFILE_NAME ".SPYRE_TEMP_FILE"
+#define ROM_ALIGN	0x1000	/* file offset of the ROM, on a page so the VM can map it */
+
+/* deepest frame (in slots) that gets a checked prologue */
+#define MAX_FRAME_DEPTH	0x1000
+/* stack a C function may use besides its arguments and result */
+#define CCALL_DEPTH		4
 
 typedef struct Assembler Assembler;
 typedef struct AssemblerFile AssemblerFile;
 typedef struct AssemblerLabel AssemblerLabel;
 typedef struct AssemblerConstant AssemblerConstant;
 typedef struct AssemblerInstruction AssemblerInstruction;
+typedef struct AssemblerFusion AssemblerFusion;
 typedef enum AssemblerOperand AssemblerOperand;
+typedef enum AssemblerOpcode AssemblerOpcode;
 
 enum AssemblerOperand {
 	NO_OPERAND = 0,
 	_INT64,
 	_INT32,
-	_FLOAT64
+	_FLOAT64,
+	_SLOT,	/* frame slot, encoded as _INT32 */
+	_LABEL	/* code address, encoded as _INT32 */
+};
+
+/* opcodes, must match instructions[] */
+enum AssemblerOpcode {
+	OP_NOOP		= 0x00,
+	OP_IPUSH	= 0x01,
+	OP_IADD		= 0x02,
+	OP_ISUB		= 0x03,
+	OP_IMUL		= 0x04,
+	OP_IDIV		= 0x05,
+	OP_MOD		= 0x06,
+	OP_SHL		= 0x07,
+	OP_SHR		= 0x08,
+	OP_AND		= 0x09,
+	OP_OR		= 0x0A,
+	OP_XOR		= 0x0B,
+	OP_NOT		= 0x0C,
+	OP_NEG		= 0x0D,
+	OP_IGT		= 0x0E,
+	OP_IGE		= 0x0F,
+	OP_ILT		= 0x10,
+	OP_ILE		= 0x11,
+	OP_ICMP		= 0x12,
+	OP_JNZ		= 0x13,
+	OP_JZ		= 0x14,
+	OP_JMP		= 0x15,
+	OP_CALL		= 0x16,
+	OP_IRET		= 0x17,
+	OP_CCALL	= 0x18,
+	OP_FPUSH	= 0x19,
+	OP_FADD		= 0x1A,
+	OP_FSUB		= 0x1B,
+	OP_FMUL		= 0x1C,
+	OP_FDIV		= 0x1D,
+	OP_FGT		= 0x1E,
+	OP_FGE		= 0x1F,
+	OP_FLT		= 0x20,
+	OP_FLE		= 0x21,
+	OP_FCMP		= 0x22,
+	OP_FRET		= 0x23,
+	OP_ILLOAD	= 0x24,
+	OP_ILSAVE	= 0x25,
+	OP_IARG		= 0x26,
+	OP_ILOAD	= 0x27,
+	OP_ISAVE	= 0x28,
+	OP_RES		= 0x29,
+	OP_LEA		= 0x2A,
+	OP_IDER		= 0x2B,
+	OP_ICINC	= 0x2C,
+	OP_CDER		= 0x2D,
+	OP_LOR		= 0x2E,
+	OP_LAND		= 0x2F,
+	OP_PADD		= 0x30,
+	OP_PSUB		= 0x31,
+	OP_LOG		= 0x32,
+	OP_VRET		= 0x33,
+	OP_DBON		= 0x34,
+	OP_DBOFF	= 0x35,
+	OP_DBDS		= 0x36,
+	OP_CJNZ		= 0x37,
+	OP_CJZ		= 0x38,
+	OP_CJMP		= 0x39,
+	OP_ILNSAVE	= 0x3A,
+	OP_ILNLOAD	= 0x3B,
+	OP_FLLOAD	= 0x3C,
+	OP_FLSAVE	= 0x3D,
+	OP_FTOI		= 0x3E,
+	OP_ITOF		= 0x3F,
+	OP_FDER		= 0x40,
+	OP_FSAVE	= 0x41,
+	OP_LNOT		= 0x42,
+	OP_RISET	= 0x43,
+	OP_RFSET	= 0x44,
+	OP_RMOV		= 0x45,
+	OP_RIADD	= 0x46,
+	OP_RISUB	= 0x47,
+	OP_RIMUL	= 0x48,
+	OP_RIDIV	= 0x49,
+	OP_RFADD	= 0x4A,
+	OP_RFSUB	= 0x4B,
+	OP_RFMUL	= 0x4C,
+	OP_RFDIV	= 0x4D,
+	OP_ILLADD	= 0x4E,
+	OP_FLLADD	= 0x4F,
+	OP_FLLSUB	= 0x50,
+	OP_FLLMUL	= 0x51,
+	OP_ILINC	= 0x52,
+	OP_ILFIELD	= 0x53,
+	OP_FLFIELD	= 0x54,
+	OP_ICIDER	= 0x55,
+	OP_ICFDER	= 0x56,
+	OP_RIADDI	= 0x57,
+	OP_ILTJZ	= 0x58,
+	OP_ILEJZ	= 0x59,
+	OP_ICMPJZ	= 0x5A,
+	OP_ENTER	= 0x5B,
+	OP_COCREATE	= 0x5C,
+	OP_RESUME	= 0x5D,
+	OP_YIELD	= 0x5E,
+	OP_COSTATUS	= 0x5F,
+	OP_TAILCALL	= 0x60,
+	OP_MEMCPY	= 0x61,
+	OP_MEMSET	= 0x62,
+	OP_MEMMOVE	= 0x63,
+	OP_VLLOAD	= 0x64,
+	OP_VLSAVE	= 0x65,
+	OP_VLOAD	= 0x66,
+	OP_VSAVE	= 0x67,
+	OP_VFADD	= 0x68,
+	OP_VFSUB	= 0x69,
+	OP_VFMUL	= 0x6A,
+	OP_VFDIV	= 0x6B,
+	OP_VIADD	= 0x6C,
+	OP_VISUB	= 0x6D,
+	OP_VIMUL	= 0x6E,
+	OP_VFCMP	= 0x6F,
+	OP_VICMP	= 0x70,
+	OP_VSELECT	= 0x71,
+	OP_VSPLAT	= 0x72,
+	OP_VLANE	= 0x73,
+	OP_FSQRT	= 0x74,
+	OP_FSIN		= 0x75,
+	OP_FCOS		= 0x76,
+	OP_FTAN		= 0x77,
+	OP_FABS		= 0x78,
+	OP_FFLOOR	= 0x79,
+	OP_FCEIL	= 0x7A,
+	OP_FMIN		= 0x7B,
+	OP_FMAX		= 0x7C,
+	OP_FFMA		= 0x7D,
+	OP_IMIN		= 0x7E,
+	OP_IMAX		= 0x7F,
+	OP_IABS		= 0x80
 };
 
 struct Assembler {
@@ -51,12 +194,27 @@ struct AssemblerInstruction {
 	AssemblerOperand	operands[4];
 };
 
+/* a superinstruction, replaces a sequence of instructions with one 
+ * that takes all of their operands in order.  if same is non-zero, 
+ * operand (same) must be identical to operand 0 and is dropped 
+ */
+struct AssemblerFusion {
+	const char*			sequence[4];
+	const char*			fused;
+	int					same;
+};
+
 extern const AssemblerInstruction instructions[0xFF];
 
 void Assembler_generateBytecodeFile(const char*);
 static void	Assembler_die(Assembler*, const char*, ...);
 static void Assembler_appendLabel(Assembler*, const char*, uint32_t);
 static void Assembler_appendConstant(Assembler*, const char*, uint32_t);
+static void Assembler_fuseInstructions(Assembler*);
+static void Assembler_analyzeFrames(Assembler*);
+static int Assembler_stackEffect(const AssemblerInstruction*, AssemblerToken**, int, int*, int*);
+static int Assembler_findLabel(const char**, const int*, int, const char*);
+static AssemblerToken* Assembler_skipOperands(Assembler*, AssemblerToken*, const AssemblerInstruction*);
 static const AssemblerInstruction* Assembler_validateInstruction(Assembler*, const char*);
 static int strcmp_lower(const char*, const char*);
 
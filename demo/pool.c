@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include "pool.h"
+
+/* runs power from pool.spys on a pool of workers, from the top directory:
+ *	make build/libspy.a
+ *	spy a demo/pool.spys
+ *	gcc -std=c99 -I. demo/pool.c build/libspy.a -o pool -lm -pthread
+ *	./pool demo/pool.spyb
+ */
+
+/* a job's entry is the bytecode offset of the function it calls, counted
+ * from the first instruction.  power follows the leading jmp (one byte of
+ * opcode, four of target) so it's at 5
+ */
+#define POWER	5
+
+int main(int argc, char** argv) {
+	SpyJob jobs[16];
+	int64_t args[16][2];
+
+	if (argc <= 1) return printf("expected file name\n");
+
+	SpyPool* P = Spy_newPool(argv[1], SPY_NOFLAG, 4);
+
+	/* arguments are in the order they'd be pushed, so the exponent (the
+	 * last one) is iarg 0 in power.  jobs and their arguments have to stay
+	 * around until Spy_waitPool returns
+	 */
+	for (int i = 0; i < 16; i++) {
+		args[i][0] = 3;
+		args[i][1] = i;
+		jobs[i].entry = POWER;
+		jobs[i].args = args[i];
+		jobs[i].nargs = 2;
+		Spy_submit(P, &jobs[i]);
+	}
+	Spy_waitPool(P);
+
+	for (int i = 0; i < 16; i++) {
+		printf("3^%d = %lld\n", i, (long long)jobs[i].result);
+	}
+	Spy_freePool(P);
+	return 0;
+}
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include "generate.h"
+#include "spyre.h"
 
 #define LABEL_FORMAT "__LABEL__%u"
 #define FUNC_FORMAT "__FUNC__%s"
@@ -81,10 +82,20 @@ static TreeStruct* type_defined(CompileState*, const char*);
 static void comment(CompileState*, const char*, ...);
 static void token_line(CompileState*, Token*);
 static int identical_types(TreeDatatype*, TreeDatatype*);
+static int null_type(TreeDatatype*);
 static TreeDatatype* copy_datatype(TreeDatatype*);
 static void literal_scan(CompileState*);
 static void init_declarations(CompileState*, TreeBlock*);
 static TreeDatatype* raw_datatype(CompileState*, ExpNode*);
+static int register_scalar(TreeDecl*);
+static int vector_type(TreeDatatype*);
+static int vector_lane(const char*);
+static int member_next(ExpNode*);
+static void vector_splat(CompileState*, TreeDatatype*, TreeDatatype*, int);
+static ExpNode* vector_operator(CompileState*, int, TreeDatatype*, TreeDatatype*);
+static const char* intrinsic(TreeFunction*);
+static int register_assignment(CompileState*, int);
+static unsigned int register_scratch(CompileState*, TreeBlock*);
 
 /* generating (etc) functions */
 static void generate_if(CompileState*);
@@ -278,6 +289,158 @@ identical_types(TreeDatatype* a, TreeDatatype* b) {
 	return 1;
 }
 
+/* vector values take four frame (and stack) slots, a pointer to one is
+ * an ordinary pointer
+ */
+static int
+vector_type(TreeDatatype* type) {
+	return (type->type == TYPE_VEC4F || type->type == TYPE_VEC4I) && type->ptr_level == 0;
+}
+
+/* RETURN: index of lane (name), -1 if it isn't one */
+static int
+vector_lane(const char* name) {
+	static const char* lanes[] = {"x", "y", "z", "w"};
+	for (int i = 0; i < 4; i++) {
+		if (!strcmp(name, lanes[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* RETURN: 1 if (node) is followed by '.member' */
+static int
+member_next(ExpNode* node) {
+	return (
+		node->next && node->next->type == EXP_IDENTIFIER
+		&& node->next->next && node->next->next->type == EXP_OPERATOR
+		&& node->next->next->poperator->type == TOK_PERIOD
+	);
+}
+
+/* repeats the scalar of type (scalar), (depth) values down the stack,
+ * into every lane of a (vector)
+ */
+static void
+vector_splat(CompileState* C, TreeDatatype* scalar, TreeDatatype* vector, int depth) {
+	if (scalar->ptr_level > 0 || (scalar->type != TYPE_INT && scalar->type != TYPE_FLOAT)) {
+		compile_error(C, "can't use (%s) as the lanes of a %s", tostring_datatype(scalar), tostring_datatype(vector));
+	}
+	if (scalar->type == TYPE_FLOAT && vector->type == TYPE_VEC4I) {
+		compile_error(C, "can't use a float as the lanes of a vec4i");
+	}
+	if (scalar->type == TYPE_INT && vector->type == TYPE_VEC4F) {
+		C->target(C, "itof %d\n", depth);
+	}
+	C->target(C, "vsplat %d\n", depth);
+}
+
+/* (a) is the top operand, (b) the one under it.  a scalar operand is used
+ * for every lane, comparisons give a vec4i of all ones or zero lanes
+ */
+static ExpNode*
+vector_operator(CompileState* C, int operator, TreeDatatype* a, TreeDatatype* b) {
+	TreeDatatype* vector = vector_type(a) ? a : b;
+	const char prefix = vector->type == TYPE_VEC4F ? 'f' : 'i';
+	int condition = -1;
+	if (!vector_type(a)) {
+		vector_splat(C, a, vector, 0);
+	} else if (!vector_type(b)) {
+		vector_splat(C, b, vector, 4);
+	} else if (a->type != b->type) {
+		compile_error(C,
+			"attempt to perform arithmetic on non-matching types '%s' and '%s'",
+			tostring_datatype(a),
+			tostring_datatype(b)
+		);
+	}
+	ExpNode* push = malloc(sizeof(ExpNode));
+	push->type = EXP_DATATYPE;
+	push->next = NULL;
+	push->pdatatype = copy_datatype(vector);
+	switch (operator) {
+		case TOK_PLUS:
+			C->target(C, "v%cadd\n", prefix);
+			break;
+		case TOK_HYPHON:
+			C->target(C, "v%csub\n", prefix);
+			break;
+		case TOK_ASTER:
+			C->target(C, "v%cmul\n", prefix);
+			break;
+		case TOK_FORSLASH:
+			if (prefix == 'i') {
+				compile_error(C, "vec4i can't be divided");
+			}
+			C->target(C, "vfdiv\n");
+			break;
+		case TOK_EQ: condition = SPY_VEQ; break;
+		case TOK_LT: condition = SPY_VLT; break;
+		case TOK_LE: condition = SPY_VLE; break;
+		case TOK_GT: condition = SPY_VGT; break;
+		case TOK_GE: condition = SPY_VGE; break;
+		default:
+			compile_error(C, "operator can't be used on %s", tostring_datatype(vector));
+	}
+	if (condition >= 0) {
+		C->target(C, "v%ccmp %d\n", prefix, condition);
+		push->pdatatype->type = TYPE_VEC4I;
+	}
+	return push;
+}
+
+/* cfuncs the VM has an instruction for, used in place of ccall when the
+ * declaration's types are the instruction's
+ */
+static const struct {
+	const char* name;
+	const char* instruction;
+	TreeType type; /* of the arguments and the result */
+	unsigned int nargs;
+} intrinsics[] = {
+	{"sqrt",	"fsqrt",	TYPE_FLOAT,	1},
+	{"sin",		"fsin",		TYPE_FLOAT,	1},
+	{"cos",		"fcos",		TYPE_FLOAT,	1},
+	{"tan",		"ftan",		TYPE_FLOAT,	1},
+	{"fabs",	"fabs",		TYPE_FLOAT,	1},
+	{"floor",	"ffloor",	TYPE_FLOAT,	1},
+	{"ceil",	"fceil",	TYPE_FLOAT,	1},
+	{"fmin",	"fmin",		TYPE_FLOAT,	2},
+	{"fmax",	"fmax",		TYPE_FLOAT,	2},
+	{"min",		"fmin",		TYPE_FLOAT,	2},
+	{"max",		"fmax",		TYPE_FLOAT,	2},
+	{"fma",		"ffma",		TYPE_FLOAT,	3},
+	{"min",		"imin",		TYPE_INT,	2},
+	{"max",		"imax",		TYPE_INT,	2},
+	{"abs",		"iabs",		TYPE_INT,	1},
+	{NULL}
+};
+
+/* RETURN: the instruction to call cfunc (func) with, NULL for ccall */
+static const char*
+intrinsic(TreeFunction* func) {
+	for (int i = 0; intrinsics[i].name; i++) {
+		if (strcmp(func->identifier, intrinsics[i].name) || func->nargs != intrinsics[i].nargs || func->is_vararg) {
+			continue;
+		}
+		int match = func->return_type->type == intrinsics[i].type && func->return_type->ptr_level == 0;
+		for (TreeDecl* arg = func->arguments; arg && match; arg = arg->next) {
+			match = arg->datatype->type == intrinsics[i].type && arg->datatype->ptr_level == 0;
+		}
+		if (match) {
+			return intrinsics[i].instruction;
+		}
+	}
+	return NULL;
+}
+
+/* functions returning null leave nothing on the stack */
+static int
+null_type(TreeDatatype* type) {
+	return type->type == TYPE_NULL && type->ptr_level == 0;
+}
+
 static TreeStruct*
 find_struct(CompileState* C, const char* type_name) {
 	for (TreeStruct* i = C->defined_types; i; i = i->next) {
@@ -451,6 +614,80 @@ block_empty(CompileState* C) {
 	);
 }
 
+/* RETURN:
+ *	1 -> (tokens) take the address of something ('&')
+ *	0 -> they don't
+ */
+static int
+takes_address(Token* tokens) {
+	for (Token* t = tokens; t; t = t->next) {
+		if (t->type == TOK_AMPERSAND) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* takes_address for the expressions of an assignment, statement or return */
+static int
+node_takes_address(TreeNode* node) {
+	if (!node) return 0;
+	switch (node->type) {
+		case NODE_ASSIGN:
+			return takes_address(node->pass->lhs) || takes_address(node->pass->rhs);
+		case NODE_STATEMENT:
+			return takes_address(node->pstate->statement);
+		case NODE_RETURN:
+			return takes_address(node->pret->statement);
+	}
+	return 0;
+}
+
+/* RETURN:
+ *	1 -> something in (block) lives in the frame and can be pointed to,
+ *	     locals init_declarations gives memory on the stack, vectors or
+ *	     a local with '&' taken.  a tail call reuses the frame, so it
+ *	     would leave those pointers dangling
+ *	0 -> nothing in the frame is addressed
+ */
+static int
+frame_addressed(TreeBlock* block) {
+	if (!block) return 0;
+	for (TreeDecl* i = block->locals; i; i = i->next) {
+		int a = i->datatype->type == TYPE_STRUCT;
+		int b = i->datatype->ptr_level > 0;
+		if ((a && !b) || (b && !a) || vector_type(i->datatype)) {
+			return 1;
+		}
+	}
+	for (TreeNode* i = block->children; i; i = i->next) {
+		int addressed;
+		switch (i->type) {
+			case NODE_IF:
+				addressed = takes_address(i->pif->condition) || frame_addressed(i->pif->block);
+				break;
+			case NODE_WHILE:
+				addressed = takes_address(i->pwhile->condition) || frame_addressed(i->pwhile->block);
+				break;
+			case NODE_FOR:
+				addressed = (
+					node_takes_address(i->pfor->init)
+					|| takes_address(i->pfor->condition)
+					|| node_takes_address(i->pfor->statement)
+					|| frame_addressed(i->pfor->block)
+				);
+				break;
+			default:
+				addressed = node_takes_address(i);
+				break;
+		}
+		if (addressed) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 /* if a struct is declared, we need to make sure that the
  * variable is really just a pointer referring to the memory
  * on the stack
@@ -468,6 +705,10 @@ init_declarations(CompileState* C, TreeBlock* block) {
 			asmput(C, "lea %d\n", i->offset + 1);
 			asmput(C, "ilsave %d\n", i->offset);
 		}
+		if (a && !b) {
+			/* struct values start zeroed */
+			asmput(C, "lea %d\nipush 0\nipush %d\nmemset\n", i->offset + 1, i->datatype->pstruct->size * 8);
+		}
 	}
 	for (TreeNode* i = block->children; i; i = i->next) {
 		switch (i->type) {
@@ -776,6 +1017,181 @@ postfix_expression(CompileState* C, Token* expression) {
 	return postfix ? postfix->value : NULL;
 }
 
+/* RETURN:
+ *	1 -> local can live in a register (a plain int or float frame slot)
+ *	0 -> it can't
+ */
+static int
+register_scalar(TreeDecl* local) {
+	if (!local || local->datatype->ptr_level > 0) {
+		return 0;
+	}
+	return local->datatype->type == TYPE_INT || local->datatype->type == TYPE_FLOAT;
+}
+
+/* assignments of the form 'local = <arithmetic on locals and literals>'
+ * are compiled to three-address register instructions that work directly
+ * on frame slots (e.g. rfadd 3, 1, 2) instead of going through the stack.
+ * intermediate results are kept in scratch slots reserved after the locals.
+ * if emit is 0 nothing is written, it's just used to size the scratch area
+ * RETURN:
+ *	-1 -> assignment can't be done with registers, use the stack
+ *	n  -> number of scratch slots used
+ */
+static int
+register_assignment(CompileState* C, int emit) {
+	Token* lhs = C->focus->pass->lhs;
+	if (!lhs || lhs->next || lhs->type != TOK_IDENTIFIER) {
+		return -1;
+	}
+	TreeDecl* dest = find_local(C, lhs->word);
+	if (!register_scalar(dest)) {
+		return -1;
+	}
+	TreeType type = dest->datatype->type;
+	ExpNode* rhs = postfix_expression(C, C->focus->pass->rhs);
+	int depth = 0;
+	int length = 0;
+
+	/* first make sure the whole expression fits */
+	for (ExpNode* i = rhs; i; i = i->next) {
+		switch (i->type) {
+			case EXP_IDENTIFIER: {
+				TreeDecl* local = find_local(C, i->pidentifier->word);
+				if (!register_scalar(local) || local->datatype->type != type) {
+					return -1;
+				}
+				depth++;
+				break;
+			}
+			case EXP_LITERAL:
+				if (i->pliteral->datatype->type != TYPE_INT && i->pliteral->datatype->type != type) {
+					return -1;
+				}
+				depth++;
+				break;
+			case EXP_OPERATOR:
+				switch (i->poperator->type) {
+					case TOK_PLUS:
+					case TOK_HYPHON:
+					case TOK_ASTER:
+					case TOK_FORSLASH:
+						break;
+					default:
+						return -1;
+				}
+				if (depth < 2) {
+					return -1;
+				}
+				depth--;
+				break;
+			default:
+				return -1;
+		}
+		length++;
+	}
+	if (depth != 1) {
+		return -1;
+	}
+
+	/* now assign slots, scratch slots are allocated like a stack
+	 * so the ones on top are always the most recently allocated
+	 */
+	const char prefix = type == TYPE_FLOAT ? 'f' : 'i';
+	int* slots = malloc(sizeof(int) * length);
+	int* scratch = malloc(sizeof(int) * length);
+	int top = 0;
+	int used = 0;
+	int most = 0;
+	for (ExpNode* i = rhs; i; i = i->next) {
+		int is_last = !i->next;
+		int slot;
+		switch (i->type) {
+			case EXP_IDENTIFIER:
+				slots[top] = find_local(C, i->pidentifier->word)->offset;
+				scratch[top++] = 0;
+				if (is_last && emit) {
+					C->target(C, "rmov %d, %d\n", dest->offset, slots[top - 1]);
+				}
+				break;
+			case EXP_LITERAL:
+				slot = is_last ? dest->offset : C->scratch_base + used++;
+				if (emit) {
+					C->target(C, "r%cset %d, %s\n", prefix, slot, i->pliteral->word);
+				}
+				slots[top] = slot;
+				scratch[top++] = !is_last;
+				break;
+			case EXP_OPERATOR: {
+				int b = slots[--top];
+				used -= scratch[top];
+				int a = slots[--top];
+				used -= scratch[top];
+				slot = is_last ? dest->offset : C->scratch_base + used++;
+				if (emit) {
+					C->target(C, "r%c%s %d, %d, %d\n", prefix, (
+						i->poperator->type == TOK_PLUS ? "add" :
+						i->poperator->type == TOK_HYPHON ? "sub" :
+						i->poperator->type == TOK_ASTER ? "mul" : "div"
+					), slot, a, b);
+				}
+				slots[top] = slot;
+				scratch[top++] = !is_last;
+				break;
+			}
+		}
+		if (used > most) {
+			most = used;
+		}
+	}
+	free(slots);
+	free(scratch);
+	return most;
+}
+
+/* finds the number of scratch slots the register assignments in
+ * a function body need
+ */
+static unsigned int
+register_scratch(CompileState* C, TreeBlock* block) {
+	TreeNode* save = C->focus;
+	unsigned int most = 0;
+	for (TreeNode* i = block->children; i; i = i->next) {
+		TreeNode* check[2] = {i, NULL};
+		TreeBlock* inner = NULL;
+		switch (i->type) {
+			case NODE_IF:
+				inner = i->pif->block;
+				break;
+			case NODE_WHILE:
+				inner = i->pwhile->block;
+				break;
+			case NODE_FOR:
+				check[0] = i->pfor->init;
+				check[1] = i->pfor->statement;
+				inner = i->pfor->block;
+				break;
+		}
+		for (int j = 0; j < 2; j++) {
+			if (check[j] && check[j]->type == NODE_ASSIGN) {
+				C->focus = check[j];
+				int n = register_assignment(C, 0);
+				if (n > (int)most) {
+					most = n;
+				}
+			}
+		}
+		if (inner) {
+			unsigned int n = register_scratch(C, inner);
+			if (n > most) {
+				most = n;
+			}
+		}
+	}
+	C->focus = save;
+	return most;
+}
+
 /* converts an expression in postfix to bytecode...
  * use postfix_expression before calling to convert an
  * infix expression to a postfix expression 
@@ -829,6 +1245,9 @@ generate_expression(CompileState* C, ExpNode* expression, int is_lhs) {
 				/* load function arguments onto the stack */
 				ExpNode* ret = generate_expression(C, node->pcall->argument, 0);
 				for (ExpNode* i = ret; i; i = i->next) {
+					if (i->type == EXP_DATATYPE && vector_type(i->pdatatype)) {
+						compile_error(C, "vectors can't be passed to functions, pass a pointer");
+					}
 					n_call_args++;
 				}
 				if (n_call_args != func->nargs && !func->is_vararg) {
@@ -861,8 +1280,12 @@ generate_expression(CompileState* C, ExpNode* expression, int is_lhs) {
 					at_arg++;
 				}
 
-				if (func->is_cfunc) {
-					C->target(C, "ccall " CFUNC_FORMAT ", %d\n", func->identifier, n_call_args); 
+				if (func->is_cfunc && intrinsic(func)) {
+					C->target(C, "%s\n", intrinsic(func));
+				} else if (func->is_cfunc) {
+					C->target(C, "ccall " CFUNC_FORMAT ", %d, %d\n", func->identifier, n_call_args, !null_type(func->return_type));
+				} else if (node == C->tail_call) {
+					C->target(C, "tailcall " FUNC_FORMAT ", %d\n", func->identifier, n_call_args);
 				} else {
 					C->target(C, "call " FUNC_FORMAT ", %d\n", func->identifier, n_call_args);
 				}
@@ -895,8 +1318,15 @@ generate_expression(CompileState* C, ExpNode* expression, int is_lhs) {
 				/* if a local is found and the next thing isn't a period, it's a variable */
 				if (local && !next_period) {
 					push->pdatatype = copy_datatype(local->datatype);
+					/* vectors are loaded whole, members and assignments need the address */
+					if (vector_type(local->datatype)) {
+						if (is_lhs || next_ampersand || member_next(node)) {
+							C->target(C, "lea %d\n", local->offset);
+						} else {
+							C->target(C, "vlload %d\n", local->offset);
+						}
 					/* if it's a struct load its address */
-					if (local->datatype->type == TYPE_STRUCT) {
+					} else if (local->datatype->type == TYPE_STRUCT) {
 						if ((is_lhs && local->datatype->ptr_level >= 1) || next_ampersand) {
 							C->target(C, "lea %d\n", local->offset);
 						} else {
@@ -943,7 +1373,9 @@ generate_expression(CompileState* C, ExpNode* expression, int is_lhs) {
 						compile_error(C, "the '.' operator can't be used on a literal");
 					}
 					int found_member = 0;
-					if (top->type == EXP_DATATYPE && top->pdatatype->type == TYPE_STRUCT) {
+					if (top->type == EXP_DATATYPE && vector_type(top->pdatatype)) {
+						found_member = vector_lane(node->pidentifier->word) >= 0;
+					} else if (top->type == EXP_DATATYPE && top->pdatatype->type == TYPE_STRUCT) {
 						for (TreeDecl* i = top->pdatatype->pstruct->children; i; i = i->next) {
 							if (!strcmp(i->identifier, node->pidentifier->word)) {
 								found_member = 1;
@@ -978,6 +1410,20 @@ generate_expression(CompileState* C, ExpNode* expression, int is_lhs) {
 					/* dereferencing a struct.... we already made sure that B is
 					 * a member of A (assuming form A.B)
 					 */
+					if (pop[1]->type == EXP_DATATYPE && vector_type(pop[1]->pdatatype)) {
+						/* a lane, the vector's address is on the stack */
+						ExpNode* push = malloc(sizeof(ExpNode));
+						push->type = EXP_DATATYPE;
+						push->next = NULL;
+						push->pdatatype = copy_datatype(pop[1]->pdatatype);
+						push->pdatatype->type = pop[1]->pdatatype->type == TYPE_VEC4F ? TYPE_FLOAT : TYPE_INT;
+						C->target(C, "icinc %d\n", vector_lane(pop[0]->pidentifier->word) * 8);
+						if (!is_lhs && !(node->next && node->next->type == EXP_OPERATOR && node->next->poperator->type == TOK_AMPERSAND)) {
+							C->target(C, "%cder\n", push->pdatatype->type == TYPE_FLOAT ? 'f' : 'i');
+						}
+						exp_push(&stack, push);
+						break;
+					}
 					if (!(pop[1]->type == EXP_DATATYPE && pop[1]->pdatatype->type == TYPE_STRUCT)) {
 						compile_error(C, "the '.' operator can only be used on structs");
 					}
@@ -999,7 +1445,11 @@ generate_expression(CompileState* C, ExpNode* expression, int is_lhs) {
 							push->pdatatype = copy_datatype(i->datatype);
 							C->target(C, "icinc %d\n", i->offset * 8);
 							/* don't dereference if its lhs, ampersand next, or a struct */
-							if (!is_lhs && !next_ampersand && i->datatype->type != TYPE_STRUCT) {
+							if (vector_type(i->datatype)) {
+								if (!is_lhs && !next_ampersand && !member_next(node)) {
+									C->target(C, "vload\n");
+								}
+							} else if (!is_lhs && !next_ampersand && i->datatype->type != TYPE_STRUCT) {
 								C->target(C, "%cder\n", prefix);
 							}
 							break;
@@ -1047,6 +1497,15 @@ generate_expression(CompileState* C, ExpNode* expression, int is_lhs) {
 							case TYPE_FLOAT:
 								C->target(C, "fder\n");
 								break;
+							case TYPE_VEC4F:
+							case TYPE_VEC4I:
+								/* a lane needs the address */
+								if (newtype->ptr_level > 0) {
+									C->target(C, "ider\n");
+								} else if (!member_next(node)) {
+									C->target(C, "vload\n");
+								}
+								break;
 							default:
 								/* if we're assigning to a single struct pointer (LHS),
 								 * DEREFERENCE TWICE!
@@ -1060,6 +1519,8 @@ generate_expression(CompileState* C, ExpNode* expression, int is_lhs) {
 						pop[0]->pdatatype = newtype;
 					}
 					exp_push(&stack, pop[0]);
+				} else if (vector_type(raw_datatype(C, pop[0])) || vector_type(raw_datatype(C, pop[1]))) {
+					exp_push(&stack, vector_operator(C, node->poperator->type, raw_datatype(C, pop[0]), raw_datatype(C, pop[1])));
 				} else {
 					ExpNode* push;
 					TreeDatatype* a = raw_datatype(C, pop[0]);
@@ -1259,6 +1720,14 @@ generate_function_decl(CompileState* C) {
 	if (C->focus->pfunc->is_cfunc) {
 		return;
 	}
+	for (TreeDecl* i = C->focus->pfunc->arguments; i; i = i->next) {
+		if (vector_type(i->datatype)) {
+			compile_error(C, "vectors can't be passed to functions, pass a pointer");
+		}
+	}
+	if (vector_type(C->focus->pfunc->return_type)) {
+		compile_error(C, "vectors can't be returned from functions");
+	}
 	asmput(C, "\n\n" DEF_FUNC "\n", C->focus->pfunc->identifier);
 	C->return_label = C->label_count++;
 	C->func = C->focus->pfunc;
@@ -1268,27 +1737,37 @@ generate_function_decl(CompileState* C) {
 	 * larger sizes... make sure to allocate enough space
 	 * for them in the future
 	 */
+	C->scratch_base = C->focus->pfunc->reserve_space;
+	C->frame_addressed = frame_addressed(C->focus->pfunc->block);
+	C->focus->pfunc->reserve_space += register_scratch(C, C->focus->pfunc->block);
 	asmput(C, "res %d\n", C->focus->pfunc->reserve_space);
 	
-	/* push the arguments and assign them to their proper offset */	
+	/* push the arguments and assign them to their proper offset, the
+	 * caller pushes them in order so the last one is iarg 0
+	 */
 	for (int i = 0; i < C->focus->pfunc->nargs; i++) {
-		asmput(C, "iarg %d\n", i);	
+		asmput(C, "iarg %d\n", C->focus->pfunc->nargs - 1 - i);	
 		asmput(C, "ilsave %d\n", i);
 	}
 	
+	const char* ret = null_type(C->focus->pfunc->return_type) ? "vret\n" : "iret\n";
 	if (C->focus->pfunc->block->children) {
 		init_declarations(C, C->focus->pfunc->block);
 		push_instruction(C, DEF_LABEL, C->return_label);
-		push_instruction(C, "iret\n");
+		push_instruction(C, ret);
 	} else {
 		asmput(C, DEF_LABEL, C->return_label);
-		asmput(C, "iret\n");
+		asmput(C, ret);
 	}
 }
 
 static void
 generate_assignment(CompileState* C) {
 
+	if (register_assignment(C, 1) >= 0) {
+		return;
+	}
+
 	ExpNode* lhs = generate_expression(C, postfix_expression(C, C->focus->pass->lhs), 1);
 	ExpNode* rhs = generate_expression(C, postfix_expression(C, C->focus->pass->rhs), 0);
 
@@ -1297,6 +1776,30 @@ generate_assignment(CompileState* C) {
 		compile_error(C, "didn't pop LHS and RHS as datatypes...");
 	}
 	
+	/* struct values are copied whole, both sides are the address of the data */
+	if (
+		lhs->pdatatype->type == TYPE_STRUCT && lhs->pdatatype->ptr_level == 0
+		&& identical_types(lhs->pdatatype, rhs->pdatatype)
+	) {
+		C->target(C, "ipush %d\nmemcpy\n", lhs->pdatatype->pstruct->size * 8);
+		return;
+	}
+
+	/* vectors are stored whole, a scalar goes in every lane */
+	if (vector_type(lhs->pdatatype)) {
+		if (!vector_type(rhs->pdatatype)) {
+			vector_splat(C, rhs->pdatatype, lhs->pdatatype, 0);
+		} else if (lhs->pdatatype->type != rhs->pdatatype->type) {
+			compile_error(C,
+				"attempt to assign '%s' to '%s'",
+				tostring_datatype(rhs->pdatatype),
+				tostring_datatype(lhs->pdatatype)
+			);
+		}
+		C->target(C, "vsave\n");
+		return;
+	}
+
 	/* implicit cast if needed */
 	if (lhs->pdatatype->type == TYPE_FLOAT && rhs->pdatatype->type == TYPE_INT) {
 		C->target(C, "itof 0\n");
@@ -1327,7 +1830,23 @@ generate_return(CompileState* C) {
 	comment(C, "return ");
 	token_line(C, C->focus->pret->statement);
 	asmput(C, "\n");
-	ExpNode* ret = generate_expression(C, postfix_expression(C, C->focus->pret->statement), 0);
+	ExpNode* expression = postfix_expression(C, C->focus->pret->statement);
+	/* returning exactly what a Spyre function returns reuses the frame,
+	 * unless something in the frame can be pointed to
+	 */
+	if (
+		expression->type == EXP_FUNC_CALL
+		&& !expression->next
+		&& !C->frame_addressed
+		&& !expression->pcall->func->is_cfunc
+		&& identical_types(expression->pcall->func->return_type, C->func->return_type)
+	) {
+		C->tail_call = expression;
+		generate_expression(C, expression, 0);
+		C->tail_call = NULL;
+		return;
+	}
+	ExpNode* ret = generate_expression(C, expression, 0);
 	if (C->func->return_type->type == TYPE_INT && ret->pdatatype->type == TYPE_FLOAT) {
 		asmput(C, "ftoi 0\n");
 	} else if (C->func->return_type->type == TYPE_FLOAT && ret->pdatatype->type == TYPE_INT) {
@@ -1358,6 +1877,9 @@ generate_bytecode(ParseState* P, const char* fout_name) {
 	C->literal_count = 0;
 	C->return_label = 0;
 	C->if_label = 0;
+	C->scratch_base = 0;
+	C->frame_addressed = 0;
+	C->tail_call = NULL;
 	C->top_label = 0;
 	C->bottom_label = 0;
 	C->token = NULL;
@@ -35,6 +35,9 @@ struct CompileState {
 	unsigned int top_label;
 	unsigned int bottom_label;
 	unsigned int if_label;
+	unsigned int scratch_base; /* first frame slot free for register scratch */
+	struct ExpNode* tail_call; /* call that is emitted as tailcall, see generate_return */
+	unsigned int frame_addressed; /* current function's frame can be pointed to, see frame_addressed */
 	FILE* fout;
 };
 
@@ -0,0 +1,986 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jit.h"
+#include "assembler.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define SPY_HAS_JIT
+#include <sys/mman.h>
+#endif
+
+/* baseline JIT, translates each function into x86-64 one instruction at a
+ * time.  the VM stack stays in memory, native code just keeps sp, bp and
+ * the memory base in registers.  instructions that aren't supported (calls,
+ * ccalls, debugging...) return to the interpreter, which runs them and then
+ * re-enters native code at the next instruction through a cell whose handler
+ * was swapped for enter_handler
+ */
+
+/* x86-64 registers */
+#define RAX		0
+#define RCX		1
+#define RDX		2
+#define RBX		3
+#define RSP		4
+#define RBP		5
+#define RSI		6
+#define RDI		7
+#define R12		12
+#define R13		13
+#define R14		14
+
+/* what the registers hold while in native code */
+#define JSTATE	RBX		/* SpyState* */
+#define JSP		R12		/* S->sp */
+#define JBP		R13		/* S->bp */
+#define JMEM	R14		/* S->memory */
+
+/* condition codes for jcc/setcc */
+#define CC_AE	0x3
+#define CC_E	0x4
+#define CC_NE	0x5
+#define CC_A	0x7
+#define CC_NP	0xB
+#define CC_GE	0xD
+#define CC_G	0xF
+#define CC_L	0xC
+#define CC_LE	0xE
+#define CC_JMP	-1
+
+typedef struct JITFixup JITFixup;
+
+struct JITFixup {
+	size_t		position;	/* offset of the rel32 to patch */
+	uint32_t	target;		/* cell index being jumped to */
+};
+
+static void emit_byte(SpyJIT*, uint8_t);
+static void emit_int32(SpyJIT*, uint32_t);
+static void emit_int64(SpyJIT*, uint64_t);
+static void emit_rm(SpyJIT*, uint8_t, int, uint32_t, int, int, int32_t);
+static void emit_rr(SpyJIT*, uint8_t, int, uint32_t, int, int);
+static void emit_sib(SpyJIT*, int, uint32_t, int, int, int);
+static void emit_load(SpyJIT*, int, int, int32_t);
+static void emit_store(SpyJIT*, int, int32_t, int);
+static void emit_imm(SpyJIT*, int, uint64_t);
+static void emit_addsp(SpyJIT*, int32_t);
+static void emit_push(SpyJIT*, int);
+static void emit_pop(SpyJIT*, int);
+static void emit_pushsd(SpyJIT*);
+static void emit_setcc(SpyJIT*, int);
+static void emit_exit(SpyJIT*, const SpyCell*);
+static void emit_return(SpyJIT*, int);
+static void emit_branch(SpyJIT*, int, uint32_t, JITFixup*, int*);
+static int emit_condition(SpyState*, uint32_t);
+static int resolve_fixups(SpyState*, JITFixup*, int, uint32_t, uint32_t, const size_t*);
+static int emit_instruction(SpyState*, uint32_t, JITFixup*, int*);
+
+static void
+emit_byte(SpyJIT* J, uint8_t byte) {
+	J->buffer[J->used++] = byte;
+}
+
+static void
+emit_int32(SpyJIT* J, uint32_t n) {
+	memcpy(&J->buffer[J->used], &n, 4);
+	J->used += 4;
+}
+
+static void
+emit_int64(SpyJIT* J, uint64_t n) {
+	memcpy(&J->buffer[J->used], &n, 8);
+	J->used += 8;
+}
+
+/* op reg, [base + disp32] (prefix is for SSE, opcodes > 0xFF are 0x0F xx) */
+static void
+emit_rm(SpyJIT* J, uint8_t prefix, int wide, uint32_t opcode, int reg, int base, int32_t disp) {
+	uint8_t rex = 0x40 | (wide << 3) | ((reg & 8) >> 1) | ((base & 8) >> 3);
+	if (prefix) emit_byte(J, prefix);
+	if (rex != 0x40) emit_byte(J, rex);
+	if (opcode > 0xFF) emit_byte(J, opcode >> 8);
+	emit_byte(J, opcode & 0xFF);
+	emit_byte(J, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP) emit_byte(J, 0x24);
+	emit_int32(J, disp);
+}
+
+/* op reg, rm (both registers) */
+static void
+emit_rr(SpyJIT* J, uint8_t prefix, int wide, uint32_t opcode, int reg, int rm) {
+	uint8_t rex = 0x40 | (wide << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+	if (prefix) emit_byte(J, prefix);
+	if (rex != 0x40) emit_byte(J, rex);
+	if (opcode > 0xFF) emit_byte(J, opcode >> 8);
+	emit_byte(J, opcode & 0xFF);
+	emit_byte(J, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* op reg, [base + index] */
+static void
+emit_sib(SpyJIT* J, int wide, uint32_t opcode, int reg, int base, int index) {
+	uint8_t rex = 0x40 | (wide << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+	if (rex != 0x40) emit_byte(J, rex);
+	if (opcode > 0xFF) emit_byte(J, opcode >> 8);
+	emit_byte(J, opcode & 0xFF);
+	emit_byte(J, ((reg & 7) << 3) | 0x04);
+	emit_byte(J, ((index & 7) << 3) | (base & 7));
+}
+
+static void
+emit_load(SpyJIT* J, int reg, int base, int32_t disp) {
+	emit_rm(J, 0, 1, 0x8B, reg, base, disp);
+}
+
+static void
+emit_store(SpyJIT* J, int base, int32_t disp, int reg) {
+	emit_rm(J, 0, 1, 0x89, reg, base, disp);
+}
+
+static void
+emit_imm(SpyJIT* J, int reg, uint64_t n) {
+	emit_byte(J, 0x48 | ((reg & 8) >> 3));
+	emit_byte(J, 0xB8 | (reg & 7));
+	emit_int64(J, n);
+}
+
+/* add sp, n */
+static void
+emit_addsp(SpyJIT* J, int32_t n) {
+	if (n >= -128 && n <= 127) {
+		emit_rr(J, 0, 1, 0x83, 0, JSP);
+		emit_byte(J, (uint8_t)n);
+	} else {
+		emit_rr(J, 0, 1, 0x81, 0, JSP);
+		emit_int32(J, n);
+	}
+}
+
+static void
+emit_push(SpyJIT* J, int reg) {
+	emit_addsp(J, 8);
+	emit_store(J, JSP, 0, reg);
+}
+
+static void
+emit_pop(SpyJIT* J, int reg) {
+	emit_load(J, reg, JSP, 0);
+	emit_addsp(J, -8);
+}
+
+/* pushes xmm0 */
+static void
+emit_pushsd(SpyJIT* J) {
+	emit_addsp(J, 8);
+	emit_rm(J, 0xF2, 0, 0x0F11, 0, JSP, 0);
+}
+
+/* rax = condition ? 1 : 0 */
+static void
+emit_setcc(SpyJIT* J, int cc) {
+	emit_rr(J, 0, 0, 0x0F90 | cc, 0, RAX);
+	emit_rr(J, 0, 0, 0x0FB6, RAX, RAX);
+}
+
+/* leave native code, the interpreter continues at (cell) */
+static void
+emit_exit(SpyJIT* J, const SpyCell* cell) {
+	emit_imm(J, RAX, (uintptr_t)cell);
+	emit_return(J, RAX);
+}
+
+/* leave native code, the interpreter continues at the cell in (reg) */
+static void
+emit_return(SpyJIT* J, int reg) {
+	if (reg != RAX) {
+		emit_rr(J, 0, 1, 0x89, reg, RAX);
+	}
+	emit_byte(J, 0xE9);
+	emit_int32(J, J->epilogue - (J->used + 4));
+}
+
+/* jump to a cell, patched once the whole function is emitted */
+static void
+emit_branch(SpyJIT* J, int cc, uint32_t target, JITFixup* fixups, int* nfixups) {
+	if (cc == CC_JMP) {
+		emit_byte(J, 0xE9);
+	} else {
+		emit_byte(J, 0x0F);
+		emit_byte(J, 0x80 | cc);
+	}
+	fixups[*nfixups].position = J->used;
+	fixups[*nfixups].target = target;
+	(*nfixups)++;
+	emit_int32(J, 0);
+}
+
+/* pops the operands of a conditional jump and sets the flags,
+ * RETURN: condition code that is true when the jump is taken
+ */
+static int
+emit_condition(SpyState* S, uint32_t index) {
+	SpyJIT* J = S->jit;
+	uint8_t op = S->code_ops[index];
+	if (op == OP_JZ || op == OP_JNZ) {
+		emit_pop(J, RAX);
+		emit_rr(J, 0, 1, 0x85, RAX, RAX);
+		return op == OP_JZ ? CC_E : CC_NE;
+	}
+	emit_load(J, RAX, JSP, -8);
+	emit_rm(J, 0, 1, 0x3B, RAX, JSP, 0);
+	emit_rm(J, 0, 1, 0x8D, JSP, JSP, -16); /* lea keeps the flags */
+	return (
+		op == OP_ILTJZ ? CC_GE :
+		op == OP_ILEJZ ? CC_G : CC_NE
+	);
+}
+
+/* RETURN:
+ *	1 -> instruction was compiled
+ *	0 -> not supported, caller has to hand it to the interpreter
+ */
+static int
+emit_instruction(SpyState* S, uint32_t index, JITFixup* fixups, int* nfixups) {
+	SpyJIT* J = S->jit;
+	const SpyCell* arg = &S->code[index + 1];
+	uint8_t op = S->code_ops[index];
+	switch (op) {
+		case OP_IPUSH:
+		case OP_FPUSH:
+			emit_imm(J, RAX, arg[0].i);
+			emit_push(J, RAX);
+			return 1;
+		case OP_IADD:
+		case OP_ISUB:
+		case OP_AND:
+		case OP_OR:
+		case OP_XOR:
+			emit_pop(J, RAX);
+			emit_rm(J, 0, 1, (
+				op == OP_IADD ? 0x01 :
+				op == OP_ISUB ? 0x29 :
+				op == OP_AND ? 0x21 :
+				op == OP_OR ? 0x09 : 0x31
+			), RAX, JSP, 0);
+			return 1;
+		case OP_IMUL:
+			emit_load(J, RAX, JSP, -8);
+			emit_rm(J, 0, 1, 0x0FAF, RAX, JSP, 0);
+			emit_addsp(J, -8);
+			emit_store(J, JSP, 0, RAX);
+			return 1;
+		case OP_IDIV:
+		case OP_MOD:
+			emit_load(J, RAX, JSP, -8);
+			emit_byte(J, 0x48); /* cqo */
+			emit_byte(J, 0x99);
+			emit_rm(J, 0, 1, 0xF7, 7, JSP, 0);
+			emit_addsp(J, -8);
+			emit_store(J, JSP, 0, op == OP_IDIV ? RAX : RDX);
+			return 1;
+		case OP_SHL:
+		case OP_SHR:
+			emit_pop(J, RCX);
+			emit_rm(J, 0, 1, 0xD3, op == OP_SHL ? 4 : 7, JSP, 0);
+			return 1;
+		case OP_NOT:
+		case OP_NEG:
+			emit_rm(J, 0, 1, 0xF7, op == OP_NOT ? 2 : 3, JSP, 0);
+			return 1;
+		case OP_IGT:
+		case OP_IGE:
+		case OP_ILT:
+		case OP_ILE:
+		case OP_ICMP:
+			emit_load(J, RAX, JSP, -8);
+			emit_rm(J, 0, 1, 0x3B, RAX, JSP, 0);
+			emit_setcc(J, (
+				op == OP_IGT ? CC_G :
+				op == OP_IGE ? CC_GE :
+				op == OP_ILT ? CC_L :
+				op == OP_ILE ? CC_LE : CC_E
+			));
+			emit_addsp(J, -8);
+			emit_store(J, JSP, 0, RAX);
+			return 1;
+		case OP_LNOT:
+			emit_rm(J, 0, 1, 0x83, 7, JSP, 0);
+			emit_byte(J, 0);
+			emit_setcc(J, CC_E);
+			emit_store(J, JSP, 0, RAX);
+			return 1;
+		case OP_LAND:
+		case OP_LOR:
+			emit_load(J, RAX, JSP, -8);
+			emit_rr(J, 0, 1, 0x85, RAX, RAX);
+			emit_rr(J, 0, 0, 0x0F90 | CC_NE, 0, RAX);
+			emit_load(J, RCX, JSP, 0);
+			emit_rr(J, 0, 1, 0x85, RCX, RCX);
+			emit_rr(J, 0, 0, 0x0F90 | CC_NE, 0, RCX);
+			emit_rr(J, 0, 0, op == OP_LAND ? 0x20 : 0x08, RCX, RAX);
+			emit_rr(J, 0, 0, 0x0FB6, RAX, RAX);
+			emit_addsp(J, -8);
+			emit_store(J, JSP, 0, RAX);
+			return 1;
+		case OP_JZ:
+		case OP_JNZ:
+		case OP_ILTJZ:
+		case OP_ILEJZ:
+		case OP_ICMPJZ:
+			emit_branch(J, emit_condition(S, index), arg[0].target - S->code, fixups, nfixups);
+			return 1;
+		case OP_JMP:
+			emit_branch(J, CC_JMP, arg[0].target - S->code, fixups, nfixups);
+			return 1;
+		case OP_FADD:
+		case OP_FSUB:
+		case OP_FMUL:
+		case OP_FDIV:
+			emit_rm(J, 0xF2, 0, 0x0F10, 0, JSP, -8);
+			emit_rm(J, 0xF2, 0, (
+				op == OP_FADD ? 0x0F58 :
+				op == OP_FSUB ? 0x0F5C :
+				op == OP_FMUL ? 0x0F59 : 0x0F5E
+			), 0, JSP, 0);
+			emit_addsp(J, -8);
+			emit_rm(J, 0xF2, 0, 0x0F11, 0, JSP, 0);
+			return 1;
+		case OP_FMIN:
+		case OP_FMAX:
+			/* minsd and maxsd give the second operand when unordered, like the interpreter */
+			emit_rm(J, 0xF2, 0, 0x0F10, 0, JSP, -8);
+			emit_rm(J, 0xF2, 0, op == OP_FMIN ? 0x0F5D : 0x0F5F, 0, JSP, 0);
+			emit_addsp(J, -8);
+			emit_rm(J, 0xF2, 0, 0x0F11, 0, JSP, 0);
+			return 1;
+		case OP_FSQRT:
+			emit_rm(J, 0xF2, 0, 0x0F51, 0, JSP, 0);
+			emit_rm(J, 0xF2, 0, 0x0F11, 0, JSP, 0);
+			return 1;
+		case OP_FABS:
+			/* btr [sp], 63 */
+			emit_rm(J, 0, 1, 0x0FBA, 6, JSP, 0);
+			emit_byte(J, 63);
+			return 1;
+		case OP_IMIN:
+		case OP_IMAX:
+			emit_load(J, RAX, JSP, -8);
+			emit_load(J, RCX, JSP, 0);
+			emit_rr(J, 0, 1, 0x3B, RAX, RCX);
+			emit_rr(J, 0, 1, 0x0F40 | (op == OP_IMIN ? CC_G : CC_L), RAX, RCX);
+			emit_addsp(J, -8);
+			emit_store(J, JSP, 0, RAX);
+			return 1;
+		case OP_IABS:
+			/* neg, and take the original back when that's negative */
+			emit_load(J, RAX, JSP, 0);
+			emit_rr(J, 0, 1, 0x89, RAX, RCX);
+			emit_rr(J, 0, 1, 0xF7, 3, RCX);
+			emit_rr(J, 0, 1, 0x0F48, RCX, RAX);
+			emit_store(J, JSP, 0, RCX);
+			return 1;
+		case OP_FGT:
+		case OP_FGE:
+		case OP_FLT:
+		case OP_FLE: {
+			/* a < b is done as b > a, so unordered compares are false */
+			int swap = op == OP_FLT || op == OP_FLE;
+			emit_rm(J, 0xF2, 0, 0x0F10, 0, JSP, swap ? 0 : -8);
+			emit_rm(J, 0x66, 0, 0x0F2E, 0, JSP, swap ? -8 : 0);
+			emit_setcc(J, op == OP_FGT || op == OP_FLT ? CC_A : CC_AE);
+			emit_rr(J, 0xF2, 1, 0x0F2A, 0, RAX);
+			emit_addsp(J, -8);
+			emit_rm(J, 0xF2, 0, 0x0F11, 0, JSP, 0);
+			return 1;
+		}
+		case OP_FCMP:
+			emit_rm(J, 0xF2, 0, 0x0F10, 0, JSP, -8);
+			emit_rm(J, 0x66, 0, 0x0F2E, 0, JSP, 0);
+			emit_rr(J, 0, 0, 0x0F90 | CC_E, 0, RAX);
+			emit_rr(J, 0, 0, 0x0F90 | CC_NP, 0, RCX);
+			emit_rr(J, 0, 0, 0x20, RCX, RAX);
+			emit_rr(J, 0, 0, 0x0FB6, RAX, RAX);
+			emit_addsp(J, -8);
+			emit_store(J, JSP, 0, RAX);
+			return 1;
+		case OP_ILLOAD:
+		case OP_FLLOAD:
+			emit_load(J, RAX, JBP, arg[0].i);
+			emit_push(J, RAX);
+			return 1;
+		case OP_ILSAVE:
+		case OP_FLSAVE:
+			emit_pop(J, RAX);
+			emit_store(J, JBP, arg[0].i, RAX);
+			return 1;
+		case OP_IARG:
+			emit_load(J, RAX, JBP, -3*8 - arg[0].i*8);
+			emit_push(J, RAX);
+			return 1;
+		case OP_ILOAD:
+		case OP_IDER:
+		case OP_FDER:
+			emit_load(J, RAX, JSP, 0);
+			emit_sib(J, 1, 0x8B, RAX, JMEM, RAX);
+			emit_store(J, JSP, 0, RAX);
+			return 1;
+		case OP_CDER:
+			emit_load(J, RAX, JSP, 0);
+			emit_sib(J, 0, 0x0FB6, RAX, JMEM, RAX);
+			emit_store(J, JSP, 0, RAX);
+			return 1;
+		case OP_ISAVE:
+		case OP_FSAVE:
+			emit_load(J, RAX, JSP, 0);
+			emit_load(J, RCX, JSP, -8);
+			emit_sib(J, 1, 0x89, RAX, JMEM, RCX);
+			emit_addsp(J, -16);
+			return 1;
+		case OP_RES:
+			emit_addsp(J, arg[0].i * 8);
+			return 1;
+		case OP_ENTER: {
+			/* when the frame doesn't fit the interpreter reports it, from an
+			 * enter that can't fit either (this cell enters native code)
+			 */
+			size_t skip;
+			if (S->code[index].handler != J->enter_handler) {
+				J->overflow[0].handler = S->code[index].handler;
+				J->overflow[1].i = 0;
+				J->overflow[2].i = S->size_memory / 8;
+			}
+			emit_rm(J, 0, 1, 0x8D, RAX, JSP, (arg[0].i + arg[1].i) * 8);
+			emit_load(J, RCX, JSTATE, offsetof(SpyState, stack_limit));
+			emit_rr(J, 0, 1, 0x39, RCX, RAX);
+			skip = J->used;
+			emit_byte(J, 0x72); /* jb */
+			emit_byte(J, 0);
+			emit_exit(J, J->overflow);
+			J->buffer[skip + 1] = J->used - (skip + 2);
+			emit_addsp(J, arg[0].i * 8);
+			return 1;
+		}
+		case OP_LEA:
+			emit_rm(J, 0, 1, 0x8D, RAX, JBP, arg[0].i);
+			emit_rr(J, 0, 1, 0x29, JMEM, RAX);
+			emit_push(J, RAX);
+			return 1;
+		case OP_ICINC:
+			emit_imm(J, RAX, arg[0].i);
+			emit_rm(J, 0, 1, 0x01, RAX, JSP, 0);
+			return 1;
+		case OP_PADD:
+		case OP_PSUB:
+			emit_pop(J, RAX);
+			emit_rr(J, 0, 1, 0xC1, 4, RAX);
+			emit_byte(J, 3);
+			emit_rm(J, 0, 1, op == OP_PADD ? 0x01 : 0x29, RAX, JSP, 0);
+			return 1;
+		case OP_FTOI:
+			emit_rm(J, 0xF2, 1, 0x0F2C, RAX, JSP, -arg[0].i*8);
+			emit_store(J, JSP, -arg[0].i*8, RAX);
+			return 1;
+		case OP_ITOF:
+			emit_rm(J, 0xF2, 1, 0x0F2A, 0, JSP, -arg[0].i*8);
+			emit_rm(J, 0xF2, 0, 0x0F11, 0, JSP, -arg[0].i*8);
+			return 1;
+		case OP_IRET:
+		case OP_VRET:
+			/* same as the interpreter, then return to the caller's cell */
+			if (op == OP_IRET) {
+				emit_load(J, RAX, JSP, 0);
+			}
+			emit_rr(J, 0, 1, 0x89, JBP, JSP);
+			emit_load(J, RCX, JSP, 0);
+			emit_load(J, JBP, JSP, -8);
+			emit_load(J, RDX, JSP, -16);
+			emit_addsp(J, -24);
+			emit_rr(J, 0, 1, 0xC1, 4, RDX);
+			emit_byte(J, 3);
+			emit_rr(J, 0, 1, 0x29, RDX, JSP);
+			if (op == OP_IRET) {
+				emit_push(J, RAX);
+			}
+			emit_return(J, RCX);
+			return 1;
+		case OP_RISET:
+		case OP_RFSET:
+			emit_imm(J, RAX, arg[1].i);
+			emit_store(J, JBP, arg[0].i, RAX);
+			return 1;
+		case OP_RMOV:
+			emit_load(J, RAX, JBP, arg[1].i);
+			emit_store(J, JBP, arg[0].i, RAX);
+			return 1;
+		case OP_RIADD:
+		case OP_RISUB:
+		case OP_RIMUL:
+			emit_load(J, RAX, JBP, arg[1].i);
+			emit_rm(J, 0, 1, (
+				op == OP_RIADD ? 0x03 :
+				op == OP_RISUB ? 0x2B : 0x0FAF
+			), RAX, JBP, arg[2].i);
+			emit_store(J, JBP, arg[0].i, RAX);
+			return 1;
+		case OP_RIDIV:
+			emit_load(J, RAX, JBP, arg[1].i);
+			emit_byte(J, 0x48); /* cqo */
+			emit_byte(J, 0x99);
+			emit_rm(J, 0, 1, 0xF7, 7, JBP, arg[2].i);
+			emit_store(J, JBP, arg[0].i, RAX);
+			return 1;
+		case OP_RFADD:
+		case OP_RFSUB:
+		case OP_RFMUL:
+		case OP_RFDIV:
+			emit_rm(J, 0xF2, 0, 0x0F10, 0, JBP, arg[1].i);
+			emit_rm(J, 0xF2, 0, (
+				op == OP_RFADD ? 0x0F58 :
+				op == OP_RFSUB ? 0x0F5C :
+				op == OP_RFMUL ? 0x0F59 : 0x0F5E
+			), 0, JBP, arg[2].i);
+			emit_rm(J, 0xF2, 0, 0x0F11, 0, JBP, arg[0].i);
+			return 1;
+		case OP_ILLADD:
+			emit_load(J, RAX, JBP, arg[0].i);
+			emit_rm(J, 0, 1, 0x03, RAX, JBP, arg[1].i);
+			emit_push(J, RAX);
+			return 1;
+		case OP_FLLADD:
+		case OP_FLLSUB:
+		case OP_FLLMUL:
+			emit_rm(J, 0xF2, 0, 0x0F10, 0, JBP, arg[0].i);
+			emit_rm(J, 0xF2, 0, (
+				op == OP_FLLADD ? 0x0F58 :
+				op == OP_FLLSUB ? 0x0F5C : 0x0F59
+			), 0, JBP, arg[1].i);
+			emit_pushsd(J);
+			return 1;
+		case OP_ILINC:
+		case OP_ILFIELD:
+		case OP_FLFIELD:
+			emit_load(J, RAX, JBP, arg[0].i);
+			emit_imm(J, RCX, arg[1].i);
+			emit_rr(J, 0, 1, 0x01, RCX, RAX);
+			if (op != OP_ILINC) {
+				emit_sib(J, 1, 0x8B, RAX, JMEM, RAX);
+			}
+			emit_push(J, RAX);
+			return 1;
+		case OP_ICIDER:
+		case OP_ICFDER:
+			emit_load(J, RAX, JSP, 0);
+			emit_imm(J, RCX, arg[0].i);
+			emit_rr(J, 0, 1, 0x01, RCX, RAX);
+			emit_sib(J, 1, 0x8B, RAX, JMEM, RAX);
+			emit_store(J, JSP, 0, RAX);
+			return 1;
+		case OP_RIADDI:
+			emit_imm(J, RAX, arg[1].i);
+			emit_store(J, JBP, arg[0].i, RAX);
+			emit_rm(J, 0, 1, 0x03, RAX, JBP, arg[3].i);
+			emit_store(J, JBP, arg[2].i, RAX);
+			return 1;
+	}
+	return 0;
+}
+
+/* patches jumps to the cells [start, end) with their native code (native),
+ * anything else gets a stub that exits to the interpreter
+ * RETURN:
+ *	1 -> resolved
+ *	0 -> out of buffer space
+ */
+static int
+resolve_fixups(SpyState* S, JITFixup* fixups, int nfixups, uint32_t start, uint32_t end, const size_t* native) {
+	SpyJIT* J = S->jit;
+	for (int i = 0; i < nfixups; i++) {
+		uint32_t target = fixups[i].target;
+		size_t destination;
+		if (target >= start && target < end && S->code_ops[target] != SPY_OPERAND) {
+			destination = native[target - start];
+		} else {
+			if (J->used + 32 > J->size) {
+				return 0;
+			}
+			destination = J->used;
+			emit_exit(J, &S->code[target]);
+		}
+		int32_t rel = (int32_t)(destination - (fixups[i].position + 4));
+		memcpy(&J->buffer[fixups[i].position], &rel, 4);
+	}
+	return 1;
+}
+
+int
+SpyJIT_available(void) {
+#ifdef SPY_HAS_JIT
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* sets up the executable buffer and the trampoline that enters it,
+ * (enter_handler) is the interpreter handler that calls S->jit->enter,
+ * with SPY_TRACE backward jumps are given (loop_handler) to count them
+ */
+void
+SpyJIT_init(SpyState* S, const void* enter_handler, const void* loop_handler, const void* record_handler) {
+	S->jit = NULL;
+#ifdef SPY_HAS_JIT
+	size_t cells = S->code_map[S->bytecode_size] + 1;
+	SpyJIT* J = (SpyJIT *)malloc(sizeof(SpyJIT));
+	J->size = (SIZE_JIT_BASE + cells * SIZE_JIT_CELL + 0xFFF) & ~(size_t)0xFFF;
+	J->buffer = mmap(NULL, J->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (J->buffer == MAP_FAILED) {
+		free(J);
+		return;
+	}
+	J->used = 0;
+	J->entries = (const void **)calloc(cells, sizeof(void *));
+	J->enter_handler = enter_handler;
+	J->loop_handler = loop_handler;
+	J->record_handler = record_handler;
+	J->jump_handler = NULL;
+	J->counts = (uint32_t *)calloc(cells, sizeof(uint32_t));
+	J->aborts = (uint8_t *)calloc(cells, 1);
+	J->recording = 0;
+	J->trace = NULL;
+	J->trace_seen = NULL;
+	J->trace_saved = NULL;
+	S->jit = J;
+
+	/* const SpyCell* enter(SpyState* S, const void* address) */
+	J->enter = (SpyJITEnter)J->buffer;
+	emit_byte(J, 0x53);					/* push rbx */
+	emit_byte(J, 0x55);					/* push rbp */
+	emit_byte(J, 0x41); emit_byte(J, 0x54);	/* push r12 */
+	emit_byte(J, 0x41); emit_byte(J, 0x55);	/* push r13 */
+	emit_byte(J, 0x41); emit_byte(J, 0x56);	/* push r14 */
+	emit_rr(J, 0, 1, 0x89, RDI, JSTATE);
+	emit_load(J, JSP, JSTATE, offsetof(SpyState, sp));
+	emit_load(J, JBP, JSTATE, offsetof(SpyState, bp));
+	emit_load(J, JMEM, JSTATE, offsetof(SpyState, memory));
+	emit_rr(J, 0, 0, 0xFF, 4, RSI);		/* jmp rsi */
+
+	/* every exit jumps here with the next cell in rax */
+	J->epilogue = J->used;
+	emit_store(J, JSTATE, offsetof(SpyState, sp), JSP);
+	emit_store(J, JSTATE, offsetof(SpyState, bp), JBP);
+	emit_byte(J, 0x41); emit_byte(J, 0x5E);	/* pop r14 */
+	emit_byte(J, 0x41); emit_byte(J, 0x5D);	/* pop r13 */
+	emit_byte(J, 0x41); emit_byte(J, 0x5C);	/* pop r12 */
+	emit_byte(J, 0x5D);					/* pop rbp */
+	emit_byte(J, 0x5B);					/* pop rbx */
+	emit_byte(J, 0xC3);					/* ret */
+	mprotect(J->buffer, J->size, PROT_READ | PROT_EXEC);
+
+	if (S->option_flags & SPY_TRACE) {
+		for (uint32_t i = 0; i < cells; i++) {
+			if (S->code_ops[i] == OP_JMP && S->code[i + 1].target <= &S->code[i]) {
+				J->jump_handler = S->code[i].handler;
+				S->code[i].handler = loop_handler;
+			}
+		}
+	}
+#endif
+}
+
+void
+SpyJIT_free(SpyJIT* J) {
+#ifdef SPY_HAS_JIT
+	munmap(J->buffer, J->size);
+	free(J->entries);
+	free(J->counts);
+	free(J->aborts);
+	free(J->trace);
+	free(J->trace_seen);
+	free(J->trace_saved);
+	free(J);
+#endif
+}
+
+/* compiles the cells [start, end)
+ * RETURN:
+ *	1 -> compiled, entry points are patched into the code
+ *	0 -> out of buffer space, nothing changed
+ */
+int
+SpyJIT_compileFunction(SpyState* S, uint32_t start, uint32_t end) {
+	SpyJIT* J = S->jit;
+	size_t saved = J->used;
+	size_t* native = (size_t *)malloc((end - start) * sizeof(size_t));
+	uint8_t* resume = (uint8_t *)calloc(end - start, 1);
+	JITFixup* fixups = (JITFixup *)malloc((end - start) * sizeof(JITFixup));
+	int nfixups = 0;
+	int compiled = 1;
+	int previous = 0;
+
+	/* loop headers, the interpreter can be in the loop when it's compiled */
+	for (uint32_t i = start; i < end; i++) {
+		if (S->code_ops[i] == OP_JMP) {
+			uint32_t target = S->code[i + 1].target - S->code;
+			if (target >= start && target <= i) {
+				resume[target - start] = 1;
+			}
+		}
+	}
+
+	for (uint32_t i = start; i < end;) {
+		const AssemblerInstruction* ins = &instructions[S->code_ops[i]];
+		int supported;
+		if (J->used + 128 > J->size) {
+			compiled = 0;
+			goto done;
+		}
+		native[i - start] = J->used;
+		supported = emit_instruction(S, i, fixups, &nfixups);
+		if (!supported) {
+			emit_exit(J, &S->code[i]);
+			resume[i - start] = 0;
+		} else if (i == start || !previous) {
+			/* the interpreter comes back here after running the previous
+			 * instruction, or calls the function from here
+			 */
+			resume[i - start] = 1;
+		}
+		previous = supported;
+		i++;
+		for (int j = 0; j < 4 && ins->operands[j] != NO_OPERAND; j++) {
+			i++;
+		}
+	}
+	/* falling off the end continues in the interpreter */
+	emit_exit(J, &S->code[end]);
+
+	if (!resolve_fixups(S, fixups, nfixups, start, end, native)) {
+		compiled = 0;
+		goto done;
+	}
+
+	for (uint32_t i = start; i < end; i++) {
+		if (resume[i - start]) {
+			J->entries[i] = &J->buffer[native[i - start]];
+			S->code[i].handler = J->enter_handler;
+		}
+	}
+
+	done:
+	if (!compiled) {
+		J->used = saved;
+	}
+	free(native);
+	free(resume);
+	free(fixups);
+	return compiled;
+}
+
+/* compiles every function, functions are found from the targets of
+ * call instructions and end where the next one starts
+ */
+void
+SpyJIT_compileAll(SpyState* S) {
+#ifdef SPY_HAS_JIT
+	SpyJIT* J = S->jit;
+	if (!J) return;
+	uint32_t cells = S->code_map[S->bytecode_size] + 1;
+	uint8_t* is_function = (uint8_t *)calloc(cells, 1);
+	for (uint32_t i = 0; i < cells; i++) {
+		if (S->code_ops[i] == OP_CALL || S->code_ops[i] == OP_COCREATE || S->code_ops[i] == OP_TAILCALL) {
+			is_function[S->code[i + 1].target - S->code] = 1;
+		}
+	}
+	mprotect(J->buffer, J->size, PROT_READ | PROT_WRITE);
+	for (uint32_t i = 0; i < cells; i++) {
+		if (!is_function[i]) continue;
+		uint32_t end = i + 1;
+		while (end < cells - 1 && !is_function[end]) end++;
+		if (!SpyJIT_compileFunction(S, i, end)) {
+			Spy_log(S, "JIT buffer full, function at cell %u is interpreted\n", i);
+		}
+	}
+	mprotect(J->buffer, J->size, PROT_READ | PROT_EXEC);
+	free(is_function);
+#endif
+}
+
+/* compiles the function [start, end) while the program runs, for tiered
+ * execution (SPY_TIER)
+ * RETURN:
+ *	1 -> compiled
+ *	0 -> couldn't be, it stays interpreted
+ */
+int
+SpyJIT_compileHot(SpyState* S, uint32_t start, uint32_t end) {
+#ifdef SPY_HAS_JIT
+	SpyJIT* J = S->jit;
+	if (!J) return 0;
+	mprotect(J->buffer, J->size, PROT_READ | PROT_WRITE);
+	int compiled = SpyJIT_compileFunction(S, start, end);
+	mprotect(J->buffer, J->size, PROT_READ | PROT_EXEC);
+	return compiled;
+#else
+	return 0;
+#endif
+}
+
+/* stops recording and gives the loop's cells their handlers back, a loop
+ * that wasn't traced (aborted) counts again unless it failed too often
+ */
+static void
+stop_trace(SpyState* S, int aborted) {
+	SpyJIT* J = S->jit;
+	for (uint32_t i = J->trace_start; i <= J->trace_end; i++) {
+		if (J->trace_saved[i - J->trace_start]) {
+			S->code[i].handler = J->trace_saved[i - J->trace_start];
+		}
+	}
+	if (aborted && ++J->aborts[J->trace_end] < SPY_JIT_RETRIES) {
+		J->counts[J->trace_end] = 0;
+	} else {
+		S->code[J->trace_end].handler = J->jump_handler;
+	}
+	free(J->trace);
+	free(J->trace_seen);
+	free(J->trace_saved);
+	J->trace = NULL;
+	J->trace_seen = NULL;
+	J->trace_saved = NULL;
+	J->recording = 0;
+}
+
+/* called when the backward jump (jump) to (header) gets hot, every cell of
+ * the loop body is given record_handler until the jump is reached again
+ */
+void
+SpyJIT_startTrace(SpyState* S, const SpyCell* header, const SpyCell* jump) {
+	SpyJIT* J = S->jit;
+	if (J->recording) {
+		/* the last loop was left before its trace was done */
+		stop_trace(S, 1);
+	}
+	J->recording = 1;
+	J->trace_start = header - S->code;
+	J->trace_end = jump - S->code;
+	J->trace_length = 0;
+	J->trace = (uint32_t *)malloc((J->trace_end - J->trace_start + 1) * sizeof(uint32_t));
+	J->trace_seen = (uint8_t *)calloc(J->trace_end - J->trace_start + 1, 1);
+	J->trace_saved = (const void **)calloc(J->trace_end - J->trace_start + 1, sizeof(void *));
+	for (uint32_t i = J->trace_start; i <= J->trace_end; i++) {
+		if (S->code_ops[i] != SPY_OPERAND) {
+			J->trace_saved[i - J->trace_start] = S->code[i].handler;
+			S->code[i].handler = J->record_handler;
+		}
+	}
+}
+
+/* records (cell) into the trace, compiles it once the loop's jump is reached
+ * RETURN: handler the interpreter should run for (cell)
+ */
+const void*
+SpyJIT_record(SpyState* S, const SpyCell* cell) {
+	SpyJIT* J = S->jit;
+	uint32_t index = cell - S->code;
+	const void* handler = J->trace_saved[index - J->trace_start];
+	if (index == J->trace_start) {
+		/* the loop was left and entered again, start over */
+		J->trace_length = 0;
+		memset(J->trace_seen, 0, J->trace_end - J->trace_start + 1);
+	} else if (J->trace_length == 0 || J->trace_seen[index - J->trace_start]) {
+		/* inner loop, try again once it's traced */
+		stop_trace(S, 1);
+		return handler;
+	}
+	J->trace_seen[index - J->trace_start] = 1;
+	J->trace[J->trace_length++] = index;
+	if (index == J->trace_end || handler == J->enter_handler) {
+		/* closed the loop, or reached code that is already native */
+		SpyJIT_compileTrace(S, J->trace, J->trace_length);
+		stop_trace(S, 0);
+		if (index == J->trace_end) {
+			return J->jump_handler;
+		}
+	}
+	return handler;
+}
+
+/* compiles a recorded trace, (trace[0]) being the loop header, conditional
+ * jumps become guards that exit to the interpreter when the branch goes
+ * the other way.  opcodes are typed, so branches are the only guards
+ * RETURN:
+ *	1 -> compiled, the header enters the trace
+ *	0 -> not compiled
+ */
+int
+SpyJIT_compileTrace(SpyState* S, const uint32_t* trace, uint32_t length) {
+#ifdef SPY_HAS_JIT
+	SpyJIT* J = S->jit;
+	size_t start = J->used;
+	JITFixup* fixups = (JITFixup *)malloc(length * sizeof(JITFixup));
+	int nfixups = 0;
+	int compiled = 1;
+	uint32_t header = trace[0];
+
+	if (J->trace_saved[0] == J->enter_handler) {
+		free(fixups);
+		return 0;
+	}
+	mprotect(J->buffer, J->size, PROT_READ | PROT_WRITE);
+	for (uint32_t k = 0; k < length; k++) {
+		uint32_t index = trace[k];
+		uint8_t op = S->code_ops[index];
+		const SpyCell* arg = &S->code[index + 1];
+		if (J->used + 128 > J->size) {
+			compiled = 0;
+			break;
+		}
+		if (k > 0 && J->trace_saved[index - J->trace_start] == J->enter_handler) {
+			emit_exit(J, &S->code[index]);
+			break;
+		}
+		if (op == OP_JMP) {
+			if (k == length - 1) {
+				emit_branch(J, CC_JMP, header, fixups, &nfixups);
+			}
+			/* forward jumps just continue with the next cell */
+			continue;
+		}
+		if (op == OP_JZ || op == OP_JNZ || op == OP_ILTJZ || op == OP_ILEJZ || op == OP_ICMPJZ) {
+			uint32_t target = arg[0].target - S->code;
+			uint32_t next = index + 2;
+			int cc = emit_condition(S, index);
+			if (k + 1 < length && trace[k + 1] == target) {
+				/* taken while recording, exit when it falls through */
+				emit_branch(J, cc ^ 1, next, fixups, &nfixups);
+			} else {
+				emit_branch(J, cc, target, fixups, &nfixups);
+			}
+			continue;
+		}
+		if (!emit_instruction(S, index, fixups, &nfixups)) {
+			emit_exit(J, &S->code[index]);
+			break;
+		}
+		if (op == OP_IRET || op == OP_VRET) {
+			break;
+		}
+	}
+	if (compiled) {
+		compiled = resolve_fixups(S, fixups, nfixups, header, header + 1, &start);
+	}
+	if (compiled) {
+		J->entries[header] = &J->buffer[start];
+		J->trace_saved[0] = J->enter_handler;
+	} else {
+		J->used = start;
+	}
+	mprotect(J->buffer, J->size, PROT_READ | PROT_EXEC);
+	free(fixups);
+	return compiled;
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,53 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "spyre.h"
+
+/* size of the executable buffer, grown by the number of cells */
+#define SIZE_JIT_BASE	0x10000
+#define SIZE_JIT_CELL	64
+
+/* backward jumps taken before their loop is traced */
+#define SPY_JIT_HOTLOOP	64
+#define SPY_JIT_RETRIES	4
+
+typedef const SpyCell* (*SpyJITEnter)(SpyState*, const void*);
+
+struct SpyJIT {
+	uint8_t*		buffer;		/* mmap'd executable memory */
+	size_t			size;
+	size_t			used;
+	size_t			epilogue;	/* offset of the code that returns to the interpreter */
+	SpyJITEnter		enter;		/* trampoline, runs native code at (address) */
+	const void**	entries;	/* native entry point of each cell, NULL if none */
+	const void*		enter_handler;	/* interpreter handler that calls enter */
+	SpyCell			overflow[3];	/* enter instruction that always overflows */
+	const void*		loop_handler;	/* counts backward jumps */
+	const void*		record_handler;	/* records cells while tracing */
+	const void*		jump_handler;	/* plain jmp, for loops that are done counting */
+	uint32_t*		counts;		/* times each backward jump was taken */
+	uint8_t*		aborts;		/* failed recordings of each loop */
+
+	/* trace being recorded, loop body is the cells [trace_start, trace_end] */
+	int				recording;
+	uint32_t		trace_start;
+	uint32_t		trace_end;
+	uint32_t		trace_length;
+	uint32_t*		trace;		/* recorded cells, in order */
+	uint8_t*		trace_seen;
+	const void**	trace_saved;	/* handlers replaced by record_handler */
+};
+
+int			SpyJIT_available(void);
+void		SpyJIT_init(SpyState*, const void*, const void*, const void*);
+void		SpyJIT_free(SpyJIT*);
+void		SpyJIT_compileAll(SpyState*);
+int			SpyJIT_compileFunction(SpyState*, uint32_t, uint32_t);
+int			SpyJIT_compileHot(SpyState*, uint32_t, uint32_t);
+void		SpyJIT_startTrace(SpyState*, const SpyCell*, const SpyCell*);
+const void*	SpyJIT_record(SpyState*, const SpyCell*);
+int			SpyJIT_compileTrace(SpyState*, const uint32_t*, uint32_t);
+
+#endif
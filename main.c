@@ -5,6 +5,7 @@
 #include "lex.h"
 #include "parse.h"
 #include "generate.h"
+#include "aot.h"
 
 int correct_suffix(const char* str) {
 	size_t len = strlen(str);
@@ -14,20 +15,82 @@ int correct_suffix(const char* str) {
 	return !strncmp(&str[len - 4], ".spy", 4);
 }
 
+/* loads and runs a bytecode file with the memory sizes given, from a
+ * snapshot of it if there is one
+ */
+static void run(const char* file, unsigned int flags, const uint64_t* sizes, const char* snapshot, int argc, char** argv) {
+	SpyState* S = Spy_newStateSized(flags, sizes[0], sizes[1], sizes[2]);
+	Spy_load(S, file);
+	if (snapshot) {
+		Spy_restore(S, snapshot);
+		Spy_resume(S);
+	} else {
+		Spy_run(S, argc, argv);
+	}
+	if (flags & SPY_TIER) {
+		Spy_dumpTiers(S);
+	}
+}
+
+/* executable name for a bytecode file, the file name without .spyb */
+static char* native_name(const char* file) {
+	size_t len = strlen(file);
+	char* name = calloc(1, len + 5);
+	strcpy(name, file);
+	if (len > 5 && !strcmp(&name[len - 5], ".spyb")) {
+		name[len - 5] = 0;
+	} else {
+		strcat(name, ".out");
+	}
+	return name;
+}
+
 int main(int argc, char** argv) {
 
+	unsigned int flags = SPY_NOFLAG;
+	uint64_t sizes[] = {SIZE_ROM, SIZE_STACK, SIZE_HEAP};
+	const char* snapshot = NULL;
+
+	/* leading options */
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-jit")) {
+			flags |= SPY_JIT;
+		} else if (!strcmp(argv[1], "-trace")) {
+			flags |= SPY_TRACE;
+		} else if (!strcmp(argv[1], "-tier")) {
+			flags |= SPY_TIER;
+		} else if (!strcmp(argv[1], "-profile")) {
+			flags |= SPY_PROFILE;
+		} else if (argc > 2 && (!strcmp(argv[1], "-rom") || !strcmp(argv[1], "-stack") || !strcmp(argv[1], "-heap"))) {
+			/* memory sizes, in bytes */
+			sizes[argv[1][1] == 'r' ? 0 : argv[1][1] == 's' ? 1 : 2] = strtoull(argv[2], NULL, 0);
+			argv++;
+			argc--;
+		} else if (argc > 2 && !strcmp(argv[1], "-restore")) {
+			snapshot = argv[2];
+			argv++;
+			argc--;
+		} else {
+			printf("unknown option '%s'\n", argv[1]);
+			exit(1);
+		}
+		argv++;
+		argc--;
+	}
+
 	if (argc <= 1) return printf("expected file name\n");
 
 	char* args[] = {argv[1]};
-
-	const unsigned int flags = SPY_NOFLAG;
 	
 	if (strlen(argv[1]) == 1) {
 		if (!strncmp(argv[1], "a", 1)) {
 			Assembler_generateBytecodeFile(argv[2]);
 		} else if (!strncmp(argv[1], "r", 1)) {
 			//Spy_execute(argv[2], SPY_NOFLAG | SPY_STEP | SPY_DEBUG, 1, args);
-			Spy_execute(argv[2], flags, 1, args);
+			run(argv[2], flags, sizes, snapshot, 1, args);
+		} else if (!strncmp(argv[1], "n", 1)) {
+			/* ahead of time, bytecode file then (optionally) the executable */
+			SpyAOT_compile(argv[2], argc > 3 ? argv[3] : native_name(argv[2]));
 		} else if (!strncmp(argv[1], "c", 1)) {
 			Token* tokens = generate_tokens(argv[2]);	
 			ParseState* tree = generate_tree(tokens);
@@ -49,7 +112,7 @@ int main(int argc, char** argv) {
 		ParseState* tree = generate_tree(tokens);
 		generate_bytecode(tree, asm_file);
 		Assembler_generateBytecodeFile(asm_file);
-		Spy_execute(binary_file, flags, 1, args);
+		run(binary_file, flags, sizes, snapshot, 1, args);
 	}
 
 	return 0;
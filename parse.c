@@ -72,6 +72,9 @@ get_variable_size(ParseState* P, TreeDecl* variable) {
 		return 1;
 	}
 	*/
+	if ((variable->datatype->type == TYPE_VEC4F || variable->datatype->type == TYPE_VEC4I) && variable->datatype->ptr_level == 0) {
+		return 4;
+	}
 	if (variable->datatype->type != TYPE_STRUCT) {
 		return 1;
 		//return 8;
@@ -90,7 +93,9 @@ check_datatype(ParseState* P, const char* type_name) {
 		!strcmp(type_name, "float") ||
 		!strcmp(type_name, "string") ||
 		!strcmp(type_name, "byte") ||
-		!strcmp(type_name, "null") 
+		!strcmp(type_name, "null") ||
+		!strcmp(type_name, "vec4f") ||
+		!strcmp(type_name, "vec4i")
 	) {
 		return 1;
 	}
@@ -285,6 +290,8 @@ tostring_datatype(TreeDatatype* type) {
 		type->type == TYPE_BYTE ? "byte" :
 		type->type == TYPE_STRING ? "string" :
 		type->type == TYPE_NULL ? "null" :
+		type->type == TYPE_VEC4F ? "vec4f" :
+		type->type == TYPE_VEC4I ? "vec4i" :
 		type->pstruct->type_name
 	));
 	for (int i = 0; i < type->ptr_level; i++) {
@@ -365,7 +372,9 @@ parse_datatype(ParseState* P) {
 		!strcmp(P->token->word, "float") ? TYPE_FLOAT :
 		!strcmp(P->token->word, "string") ? TYPE_STRING :
 		!strcmp(P->token->word, "byte") ? TYPE_BYTE : 
-		!strcmp(P->token->word, "null") ? TYPE_NULL : TYPE_STRUCT
+		!strcmp(P->token->word, "null") ? TYPE_NULL :
+		!strcmp(P->token->word, "vec4f") ? TYPE_VEC4F :
+		!strcmp(P->token->word, "vec4i") ? TYPE_VEC4I : TYPE_STRUCT
 	);
 	data->pstruct = NULL;
 	if (data->type == TYPE_STRUCT) {
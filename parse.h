@@ -50,7 +50,9 @@ enum TreeType {
 	TYPE_STRING,
 	TYPE_BYTE,
 	TYPE_STRUCT,
-	TYPE_NULL
+	TYPE_NULL,
+	TYPE_VEC4F, /* four floats, the lanes are x y z w */
+	TYPE_VEC4I
 };
 
 struct TreeStruct {
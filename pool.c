@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "pool.h"
+
+/* worker pool, the program is loaded, threaded and verified once and every
+ * worker runs it with its own state (stack, heap, registers).  jobs are
+ * taken from a single queue and each one starts from a reset state
+ */
+
+static void*
+Spy_poolWorker(void* data) {
+	SpyWorker* W = (SpyWorker *)data;
+	SpyPool* P = W->pool;
+
+	pthread_mutex_lock(&P->lock);
+	while (1) {
+		while (!P->head && !P->closing) {
+			pthread_cond_wait(&P->queued, &P->lock);
+		}
+		if (!P->head) break;
+		SpyJob* job = P->head;
+		P->head = job->next;
+		if (!P->head) P->tail = NULL;
+		pthread_mutex_unlock(&P->lock);
+
+		job->result = Spy_call(W->state, job->entry, job->args, job->nargs);
+		Spy_reset(W->state);
+
+		pthread_mutex_lock(&P->lock);
+		job->done = 1;
+		if (--P->pending == 0) {
+			pthread_cond_broadcast(&P->finished);
+		}
+	}
+	pthread_mutex_unlock(&P->lock);
+	return NULL;
+}
+
+/* loads (filename) and starts (nworkers) threads to run it, tracing and
+ * debugging patch the code so they're left off, SPY_JIT compiles it once
+ * for everyone
+ */
+SpyPool*
+Spy_newPool(const char* filename, uint32_t option_flags, int nworkers) {
+	SpyPool* P = (SpyPool *)malloc(sizeof(SpyPool));
+	if (!P || nworkers < 1) {
+		Spy_crash(NULL, "couldn't create a pool of %d workers", nworkers);
+	}
+	P->program = Spy_newState(option_flags & SPY_JIT);
+	Spy_load(P->program, filename);
+	Spy_prepare(P->program);
+	P->workers = (SpyWorker *)malloc(nworkers * sizeof(SpyWorker));
+	P->nworkers = nworkers;
+	P->head = NULL;
+	P->tail = NULL;
+	P->pending = 0;
+	P->closing = 0;
+	pthread_mutex_init(&P->lock, NULL);
+	pthread_cond_init(&P->queued, NULL);
+	pthread_cond_init(&P->finished, NULL);
+	for (int i = 0; i < nworkers; i++) {
+		SpyWorker* W = &P->workers[i];
+		W->pool = P;
+		W->state = Spy_newState(option_flags);
+		Spy_share(W->state, P->program);
+		if (pthread_create(&W->thread, NULL, Spy_poolWorker, W)) {
+			Spy_crash(NULL, "couldn't start worker %d", i);
+		}
+	}
+	return P;
+}
+
+void
+Spy_submit(SpyPool* P, SpyJob* job) {
+	job->done = 0;
+	job->result = 0;
+	job->next = NULL;
+	pthread_mutex_lock(&P->lock);
+	if (P->tail) {
+		P->tail->next = job;
+	} else {
+		P->head = job;
+	}
+	P->tail = job;
+	P->pending++;
+	pthread_cond_signal(&P->queued);
+	pthread_mutex_unlock(&P->lock);
+}
+
+/* blocks until every job submitted so far is done */
+void
+Spy_waitPool(SpyPool* P) {
+	pthread_mutex_lock(&P->lock);
+	while (P->pending > 0) {
+		pthread_cond_wait(&P->finished, &P->lock);
+	}
+	pthread_mutex_unlock(&P->lock);
+}
+
+/* finishes the jobs left, then stops the workers and frees everything */
+void
+Spy_freePool(SpyPool* P) {
+	pthread_mutex_lock(&P->lock);
+	P->closing = 1;
+	pthread_cond_broadcast(&P->queued);
+	pthread_mutex_unlock(&P->lock);
+	for (int i = 0; i < P->nworkers; i++) {
+		pthread_join(P->workers[i].thread, NULL);
+		Spy_freeState(P->workers[i].state);
+	}
+	Spy_freeState(P->program);
+	pthread_mutex_destroy(&P->lock);
+	pthread_cond_destroy(&P->queued);
+	pthread_cond_destroy(&P->finished);
+	free(P->workers);
+	free(P);
+}
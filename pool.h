@@ -0,0 +1,48 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "spyre.h"
+
+typedef struct SpyJob SpyJob;
+typedef struct SpyPool SpyPool;
+typedef struct SpyWorker SpyWorker;
+
+/* a call for any worker to make, the caller owns it (and args) until
+ * Spy_waitPool returns
+ */
+struct SpyJob {
+	uint32_t		entry;		/* bytecode offset of the function to call */
+	const int64_t*	args;		/* in the order they'd be pushed */
+	uint32_t		nargs;
+	int64_t			result;		/* return value, 0 if there isn't one */
+	int				done;
+	SpyJob*			next;
+};
+
+struct SpyWorker {
+	SpyPool*		pool;
+	SpyState*		state;		/* shares the pool's program */
+	pthread_t		thread;
+};
+
+struct SpyPool {
+	SpyState*		program;	/* loaded and prepared once, never run */
+	SpyWorker*		workers;
+	int				nworkers;
+	pthread_mutex_t	lock;
+	pthread_cond_t	queued;		/* a job was submitted, or the pool is closing */
+	pthread_cond_t	finished;	/* the last pending job is done */
+	SpyJob*			head;
+	SpyJob*			tail;
+	int				pending;	/* submitted but not done */
+	int				closing;
+};
+
+SpyPool*	Spy_newPool(const char*, uint32_t, int);
+void		Spy_submit(SpyPool*, SpyJob*);
+void		Spy_waitPool(SpyPool*);
+void		Spy_freePool(SpyPool*);
+
+#endif
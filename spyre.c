@@ -1,30 +1,183 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <math.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
 #include "spyre.h"
 #include "api.h"
 #include "assembler.h"
+#include "jit.h"
+
+/* guard page of the memory in use by this thread, for Spy_guardHandler */
+static __thread uint8_t* guard_page = NULL;
+
+#ifndef _WIN32
+/* what SIGSEGV did before Spy_guardHandler, faults that aren't ours go to it */
+static struct sigaction previous_segv;
+static pthread_once_t guard_installed = PTHREAD_ONCE_INIT;
+
+/* only async-signal-safe calls in here, the VM can't continue anyway */
+static void
+Spy_guardHandler(int signal, siginfo_t* info, void* context) {
+	static const char message[] = "SPYRE RUNTIME ERROR: stack overflow\n";
+	uint8_t* address = (uint8_t *)info->si_addr;
+	if (guard_page && address >= guard_page && address < guard_page + SIZE_GUARD) {
+		write(STDERR_FILENO, message, sizeof(message) - 1);
+		_exit(1);
+	}
+	if (previous_segv.sa_flags & SA_SIGINFO) {
+		previous_segv.sa_sigaction(signal, info, context);
+	} else if (previous_segv.sa_handler != SIG_DFL && previous_segv.sa_handler != SIG_IGN) {
+		previous_segv.sa_handler(signal);
+	} else {
+		/* fault again the way it would have without us */
+		sigaction(SIGSEGV, &previous_segv, NULL);
+	}
+}
+
+static void
+Spy_installGuardHandler(void) {
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = Spy_guardHandler;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, &previous_segv);
+}
+#endif
+
+/* reserves the address space of (S)'s memory, ROM and stack are usable
+ * (their pages only become resident when touched) and the top page of the 
+ * stack is left PROT_NONE so code without a checked prologue (see enter) 
+ * faults before reaching the heap.  the heap is committed by Spy_growHeap
+ */
+static uint8_t*
+Spy_newMemory(SpyState* S) {
+#ifdef _WIN32
+	uint8_t* memory = VirtualAlloc(NULL, S->size_memory, MEM_RESERVE, PAGE_NOACCESS);
+	if (!memory || !VirtualAlloc(memory, S->start_heap - SIZE_GUARD, MEM_COMMIT, PAGE_READWRITE)) {
+		return NULL;
+	}
+	return memory;
+#else
+	uint8_t* memory = mmap(NULL, S->size_memory, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (memory == MAP_FAILED) {
+		return NULL;
+	}
+	if (mprotect(memory, S->start_heap - SIZE_GUARD, PROT_READ | PROT_WRITE)) {
+		munmap(memory, S->size_memory);
+		return NULL;
+	}
+	guard_page = &memory[S->start_heap - SIZE_GUARD];
+	pthread_once(&guard_installed, Spy_installGuardHandler);
+	return memory;
+#endif
+}
+
+/* makes the heap accessible up to vm address (end), a step at a time */
+void
+Spy_growHeap(SpyState* S, uint64_t end) {
+	if (end > S->heap_top) {
+		S->heap_top = end;
+	}
+	if (end <= S->heap_committed) return;
+	end = (end + SIZE_COMMIT - 1) & ~(uint64_t)(SIZE_COMMIT - 1);
+	if (end > S->size_memory) {
+		end = S->size_memory;
+	}
+#ifdef _WIN32
+	if (!VirtualAlloc(&S->memory[S->heap_committed], end - S->heap_committed, MEM_COMMIT, PAGE_READWRITE)) {
+#else
+	if (mprotect(&S->memory[S->heap_committed], end - S->heap_committed, PROT_READ | PROT_WRITE)) {
+#endif
+		Spy_crash(S, "couldn't commit heap memory");
+	}
+	S->heap_committed = end;
+}
 
 SpyState*
 Spy_newState(uint32_t option_flags) {
+	return Spy_newStateSized(option_flags, SIZE_ROM, SIZE_STACK, SIZE_HEAP);
+}
+
+/* a state whose memory holds up to (rom) bytes of ROM, (stack) bytes of 
+ * stack and (heap) bytes of heap, sizes are rounded up to SIZE_COMMIT
+ */
+SpyState*
+Spy_newStateSized(uint32_t option_flags, uint64_t rom, uint64_t stack, uint64_t heap) {
 	SpyState* S = (SpyState *)malloc(sizeof(SpyState));
-	S->memory = (uint8_t *)calloc(1, SIZE_MEMORY);
+	if (!S) {
+		Spy_crash(NULL, "couldn't allocate memory\n");
+	}
+	rom = (rom + SIZE_COMMIT - 1) & ~(uint64_t)(SIZE_COMMIT - 1);
+	stack = (stack + SIZE_COMMIT - 1) & ~(uint64_t)(SIZE_COMMIT - 1);
+	heap = (heap + SIZE_COMMIT - 1) & ~(uint64_t)(SIZE_COMMIT - 1);
+	if (stack < SIZE_COMMIT) stack = SIZE_COMMIT;
+	S->start_stack = rom;
+	S->start_heap = rom + stack;
+	S->size_memory = rom + stack + heap;
+	S->heap_committed = S->start_heap;
+	S->mapped = 0;
+	S->memory = Spy_newMemory(S);
+	if (!S->memory) {
+		Spy_crash(S, "couldn't reserve 0x%llx bytes of memory\n", S->size_memory);
+	}
 	S->ip = NULL; /* to be assigned when code is executed */
-	S->sp = &S->memory[START_STACK - 1]; /* stack grows upwards */
-	S->bp = &S->memory[START_STACK - 1];
+	S->filename = NULL;
+	S->file = NULL;
+	S->file_size = 0;
+	S->rom_mapped = 0;
+	S->bytecode = NULL;
+	S->bytecode_size = 0;
+	S->rom_size = 0;
+	S->heap_top = S->start_heap;
+	S->code = NULL;
+	S->code_ops = NULL;
+	S->code_map = NULL;
+	S->saved_handlers = NULL;
+	S->sp = &S->memory[S->start_stack + 2]; /* stack grows upwards */
+	S->bp = &S->memory[S->start_stack + 2];
+	S->stack_limit = &S->memory[S->start_heap - SIZE_GUARD];
+	S->coroutines = NULL;
+	S->coroutine_count = 0;
+	S->coroutine_capacity = 0;
+	S->coroutine_dead = 0;
+	S->coroutine = 0;
 	S->option_flags = option_flags;
 	S->runtime_flags = 0;
 	S->c_functions = NULL;
+	S->c_table = NULL;
+	S->c_count = 0;
 	S->memory_chunks = NULL;
+	S->jit = NULL;
+	S->tiers = NULL;
+	S->tier_count = 0;
+	S->tier_of = NULL;
+	S->tier_clock = 0;
 	SpyL_initializeStandardLibrary(S);
 	return S;
 }
 
 void 
 Spy_log(SpyState* S, const char* format, ...) {
-	if (!(S->option_flags | SPY_DEBUG)) return;
+	if (!(S->option_flags & SPY_DEBUG)) return;
 	va_list list;
 	va_start(list, format);
 	vprintf(format, list);
@@ -50,14 +203,22 @@ Spy_pushInt(SpyState* S, int64_t value) {
 
 inline uint64_t
 Spy_readInt32(SpyState* S) {
-	S->ip += 4;
-	return (uint64_t)(*(uint32_t *)(S->ip - 4));
+	return (uint64_t)(S->ip++)->i;
 }
 
 inline uint64_t
 Spy_readInt64(SpyState* S) {
-	S->ip += 8;
-	return *(uint64_t *)(S->ip - 8);
+	return (uint64_t)(S->ip++)->i;
+}
+
+inline uint8_t*
+Spy_readLocal(SpyState* S) {
+	return &S->bp[(S->ip++)->i];
+}
+
+inline const SpyCell*
+Spy_readTarget(SpyState* S) {
+	return (S->ip++)->target;
 }
 
 inline int64_t
@@ -104,8 +265,7 @@ Spy_pushFloat(SpyState* S, double value) {
 
 inline double
 Spy_readFloat(SpyState* S) {
-	S->ip += 8;
-	return *(double *)(S->ip - 8);
+	return (S->ip++)->f;
 }
 
 inline double
@@ -115,6 +275,21 @@ Spy_popFloat(SpyState* S) {
 	return result;
 }
 
+/* stack slots hold either, these reinterpret the bits */
+static inline double
+Spy_asFloat(int64_t bits) {
+	double value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+static inline int64_t
+Spy_asInt(double value) {
+	int64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
 inline void
 Spy_pushString(SpyState* S, const char* str) {
 	while (*str) {
@@ -127,11 +302,159 @@ Spy_popString(SpyState* S) {
 	return (char *)&S->memory[Spy_popInt(S)];
 }
 
+/* the host address of the (size) bytes at VM address (address), bulk
+ * operations check the whole block is inside VM memory
+ */
+static inline uint8_t*
+Spy_checkBlock(SpyState* S, int64_t address, int64_t size) {
+	if (size < 0 || address < 0 || (uint64_t)size > S->size_memory || (uint64_t)address > S->size_memory - size) {
+		Spy_crash(S, "block of %lld bytes at 0x%llx is outside memory", size, address);
+	}
+	return &S->memory[address];
+}
+
+/* four lane vector operations, (a) = (a) op (b).  SSE2 does two lanes an
+ * instruction and AVX four, lanes without an instruction (64 bit integer
+ * multiplies and compares before SSE4) are done one at a time
+ */
+static inline void
+Spy_vectorFloat(uint8_t op, double* a, const double* b) {
+#if defined(__AVX__)
+	__m256d x = _mm256_loadu_pd(a);
+	__m256d y = _mm256_loadu_pd(b);
+	x = (
+		op == OP_VFADD ? _mm256_add_pd(x, y) :
+		op == OP_VFSUB ? _mm256_sub_pd(x, y) :
+		op == OP_VFMUL ? _mm256_mul_pd(x, y) : _mm256_div_pd(x, y)
+	);
+	_mm256_storeu_pd(a, x);
+#elif defined(__SSE2__)
+	for (int i = 0; i < 4; i += 2) {
+		__m128d x = _mm_loadu_pd(&a[i]);
+		__m128d y = _mm_loadu_pd(&b[i]);
+		x = (
+			op == OP_VFADD ? _mm_add_pd(x, y) :
+			op == OP_VFSUB ? _mm_sub_pd(x, y) :
+			op == OP_VFMUL ? _mm_mul_pd(x, y) : _mm_div_pd(x, y)
+		);
+		_mm_storeu_pd(&a[i], x);
+	}
+#else
+	for (int i = 0; i < 4; i++) {
+		a[i] = (
+			op == OP_VFADD ? a[i] + b[i] :
+			op == OP_VFSUB ? a[i] - b[i] :
+			op == OP_VFMUL ? a[i] * b[i] : a[i] / b[i]
+		);
+	}
+#endif
+}
+
+static inline void
+Spy_vectorInt(uint8_t op, int64_t* a, const int64_t* b) {
+#if defined(__SSE2__)
+	if (op != OP_VIMUL) {
+		for (int i = 0; i < 4; i += 2) {
+			__m128i x = _mm_loadu_si128((const __m128i *)&a[i]);
+			__m128i y = _mm_loadu_si128((const __m128i *)&b[i]);
+			x = op == OP_VIADD ? _mm_add_epi64(x, y) : _mm_sub_epi64(x, y);
+			_mm_storeu_si128((__m128i *)&a[i], x);
+		}
+		return;
+	}
+#endif
+	for (int i = 0; i < 4; i++) {
+		a[i] = (
+			op == OP_VIADD ? a[i] + b[i] :
+			op == OP_VISUB ? a[i] - b[i] : a[i] * b[i]
+		);
+	}
+}
+
+static inline void
+Spy_vectorCompareFloat(int64_t cond, double* a, const double* b) {
+#if defined(__SSE2__)
+	for (int i = 0; i < 4; i += 2) {
+		__m128d x = _mm_loadu_pd(&a[i]);
+		__m128d y = _mm_loadu_pd(&b[i]);
+		switch (cond) {
+			case SPY_VEQ: x = _mm_cmpeq_pd(x, y); break;
+			case SPY_VNE: x = _mm_cmpneq_pd(x, y); break;
+			case SPY_VLT: x = _mm_cmplt_pd(x, y); break;
+			case SPY_VLE: x = _mm_cmple_pd(x, y); break;
+			case SPY_VGT: x = _mm_cmpgt_pd(x, y); break;
+			case SPY_VGE: x = _mm_cmpge_pd(x, y); break;
+		}
+		_mm_storeu_pd(&a[i], x);
+	}
+#else
+	int64_t* mask = (int64_t *)a;
+	for (int i = 0; i < 4; i++) {
+		int set = (
+			cond == SPY_VEQ ? a[i] == b[i] :
+			cond == SPY_VNE ? a[i] != b[i] :
+			cond == SPY_VLT ? a[i] < b[i] :
+			cond == SPY_VLE ? a[i] <= b[i] :
+			cond == SPY_VGT ? a[i] > b[i] : a[i] >= b[i]
+		);
+		mask[i] = set ? -1 : 0;
+	}
+#endif
+}
+
+static inline void
+Spy_vectorCompareInt(int64_t cond, int64_t* a, const int64_t* b) {
+#if defined(__SSE4_2__)
+	for (int i = 0; i < 4; i += 2) {
+		__m128i x = _mm_loadu_si128((const __m128i *)&a[i]);
+		__m128i y = _mm_loadu_si128((const __m128i *)&b[i]);
+		__m128i ones = _mm_set1_epi64x(-1);
+		switch (cond) {
+			case SPY_VEQ: x = _mm_cmpeq_epi64(x, y); break;
+			case SPY_VNE: x = _mm_xor_si128(_mm_cmpeq_epi64(x, y), ones); break;
+			case SPY_VLT: x = _mm_cmpgt_epi64(y, x); break;
+			case SPY_VLE: x = _mm_xor_si128(_mm_cmpgt_epi64(x, y), ones); break;
+			case SPY_VGT: x = _mm_cmpgt_epi64(x, y); break;
+			case SPY_VGE: x = _mm_xor_si128(_mm_cmpgt_epi64(y, x), ones); break;
+		}
+		_mm_storeu_si128((__m128i *)&a[i], x);
+	}
+#else
+	for (int i = 0; i < 4; i++) {
+		int set = (
+			cond == SPY_VEQ ? a[i] == b[i] :
+			cond == SPY_VNE ? a[i] != b[i] :
+			cond == SPY_VLT ? a[i] < b[i] :
+			cond == SPY_VLE ? a[i] <= b[i] :
+			cond == SPY_VGT ? a[i] > b[i] : a[i] >= b[i]
+		);
+		a[i] = set ? -1 : 0;
+	}
+#endif
+}
+
+/* (mask) = lanes of (a) where (mask) is set, of (b) elsewhere */
+static inline void
+Spy_vectorSelect(int64_t* mask, const int64_t* a, const int64_t* b) {
+#if defined(__SSE2__)
+	for (int i = 0; i < 4; i += 2) {
+		__m128i m = _mm_loadu_si128((const __m128i *)&mask[i]);
+		__m128i x = _mm_loadu_si128((const __m128i *)&a[i]);
+		__m128i y = _mm_loadu_si128((const __m128i *)&b[i]);
+		_mm_storeu_si128((__m128i *)&mask[i], _mm_or_si128(_mm_and_si128(m, x), _mm_andnot_si128(m, y)));
+	}
+#else
+	for (int i = 0; i < 4; i++) {
+		mask[i] = (mask[i] & a[i]) | (~mask[i] & b[i]);
+	}
+#endif
+}
+
 void
 Spy_dumpStack(SpyState* S) {
-	for (const uint8_t* i = &S->memory[SIZE_ROM] + 2; i <= S->sp + 7; i++) {
+	for (const uint8_t* i = &S->memory[S->start_stack] + 2; i <= S->sp + 7; i++) {
 		printf("0x%08lx: %02x | %c | ", i - S->memory, *i, isprint(*i) ? *i : '.');	
-		if ((&S->memory[SIZE_ROM] - i + 1) % 8 == 0) {
+		if ((&S->memory[S->start_stack] - i + 1) % 8 == 0) {
 			fputc('\n', stdout);
 			for (int j = 0; j < 24; j++) {
 				fputc('-', stdout);
@@ -173,74 +496,1368 @@ Spy_pushC(SpyState* S, const char* identifier, uint32_t (*function)(SpyState*))
 		while (at->next) at = at->next;
 		at->next = container;
 	}
+	S->c_table = realloc(S->c_table, (S->c_count + 1) * sizeof(*S->c_table));
+	S->c_table[S->c_count++] = function;
+}
+
+/* returns the index of C function (identifier) in S->c_table, -1 if none */
+int64_t
+Spy_findC(SpyState* S, const char* identifier) {
+	int64_t index = 0;
+	for (SpyCFunction* at = S->c_functions; at; at = at->next) {
+		if (!strcmp(at->identifier, identifier)) {
+			return index;
+		}
+		index++;
+	}
+	return -1;
+}
+
+/* returns the cell of the instruction at (offset) in the bytecode */
+const SpyCell*
+Spy_codeAt(SpyState* S, uint64_t offset) {
+	if (offset > S->bytecode_size || S->code_map[offset] == SPY_NOCELL) {
+		Spy_crash(S, "jump to 0x%llx, which isn't the start of an instruction", offset);
+	}
+	return &S->code[S->code_map[offset]];
+}
+
+/* swaps the running context with the one saved in (co) */
+static void
+Spy_switchCoroutine(SpyState* S, SpyCoroutine* co) {
+	const SpyCell* ip = S->ip;
+	uint8_t* sp = S->sp;
+	uint8_t* bp = S->bp;
+	uint8_t* stack_limit = S->stack_limit;
+	S->ip = co->ip;
+	S->sp = co->sp;
+	S->bp = co->bp;
+	S->stack_limit = co->stack_limit;
+	co->ip = ip;
+	co->sp = sp;
+	co->bp = bp;
+	co->stack_limit = stack_limit;
+}
+
+static SpyCoroutine*
+Spy_getCoroutine(SpyState* S, int64_t handle) {
+	if (handle < 1 || handle > S->coroutine_count) {
+		Spy_crash(S, "invalid coroutine (%lld)", handle);
+	}
+	return &S->coroutines[handle - 1];
+}
+
+/* makes a suspended coroutine that calls (entry) with the (nargs) arguments
+ * on top of the stack, on a stack of its own of (size) bytes.  it returns 
+ * to (exit), which finishes the coroutine.  the slot of a dead coroutine is
+ * reused when there is one, so its handle may come back.  RETURN: its handle
+ */
+static int64_t
+Spy_newCoroutine(SpyState* S, const SpyCell* entry, uint32_t nargs, uint64_t size, const SpyCell* exit) {
+	SpyCoroutine* co;
+	uint64_t stack;
+	uint32_t handle;
+	if (size < SIZE_COSTACK) size = SIZE_COSTACK;
+	if (!S->coroutine_dead && S->coroutine_count == S->coroutine_capacity) {
+		S->coroutine_capacity = S->coroutine_capacity ? S->coroutine_capacity * 2 : 16;
+		S->coroutines = (SpyCoroutine *)realloc(S->coroutines, S->coroutine_capacity * sizeof(SpyCoroutine));
+		if (!S->coroutines) {
+			Spy_crash(S, "couldn't allocate memory for coroutines\n");
+		}
+	}
+	Spy_pushInt(S, size);
+	SpyL_malloc(S);
+	stack = Spy_popInt(S);
+	if (!stack) {
+		Spy_crash(S, "out of memory for a coroutine stack of %llu bytes", size);
+	}
+	if (S->coroutine_dead) {
+		handle = S->coroutine_dead;
+		S->coroutine_dead = S->coroutines[handle - 1].next_dead;
+	} else {
+		handle = ++S->coroutine_count;
+	}
+	co = &S->coroutines[handle - 1];
+	co->stack = stack;
+	co->stack_limit = &S->memory[stack + size - 8];
+	co->resumer = 0;
+	co->status = SPY_COSUSPENDED;
+
+	/* same frame call builds, the arguments move to the new stack */
+	co->sp = &S->memory[stack] - 8 + nargs * 8;
+	S->sp -= nargs * 8;
+	memcpy(&S->memory[stack], S->sp + 8, nargs * 8);
+	*(int64_t *)(co->sp += 8) = nargs;
+	*(uint8_t **)(co->sp += 8) = NULL;
+	*(const SpyCell **)(co->sp += 8) = exit;
+	co->bp = co->sp;
+	co->ip = entry;
+	return handle;
+}
+
+static void
+Spy_resumeCoroutine(SpyState* S, int64_t handle) {
+	SpyCoroutine* co = Spy_getCoroutine(S, handle);
+	if (co->status != SPY_COSUSPENDED) {
+		Spy_crash(S, "attempt to resume a %s coroutine", co->status == SPY_CODEAD ? "dead" : "running");
+	}
+	co->status = SPY_CORUNNING;
+	co->resumer = S->coroutine;
+	S->coroutine = handle;
+	Spy_switchCoroutine(S, co);
+}
+
+/* suspends the running coroutine, (value) goes to its resumer */
+static void
+Spy_yieldCoroutine(SpyState* S, int64_t value) {
+	if (!S->coroutine) {
+		Spy_crash(S, "yield outside of a coroutine");
+	}
+	SpyCoroutine* co = Spy_getCoroutine(S, S->coroutine);
+	co->status = SPY_COSUSPENDED;
+	S->coroutine = co->resumer;
+	Spy_switchCoroutine(S, co);
+	Spy_pushInt(S, value);
+}
+
+/* the running coroutine's function returned, its stack is freed, its slot
+ * is left for the next cocreate and the return value (0 if none) goes to
+ * its resumer 
+ */
+static void
+Spy_finishCoroutine(SpyState* S) {
+	SpyCoroutine* co = Spy_getCoroutine(S, S->coroutine);
+	int64_t value = S->sp >= &S->memory[co->stack] ? Spy_popInt(S) : 0;
+	co->status = SPY_CODEAD;
+	co->next_dead = S->coroutine_dead;
+	S->coroutine_dead = S->coroutine;
+	S->coroutine = co->resumer;
+	Spy_switchCoroutine(S, co);
+	Spy_pushInt(S, co->stack);
+	SpyL_free(S);
+	Spy_pushInt(S, value);
+}
+
+/* translates the bytecode into an array of cells holding the address of
+ * each instruction's handler and its operands, decoded once here so the
+ * interpreter doesn't have to.  frame slots become byte offsets from bp,
+ * jump targets become pointers to cells and C function names (in ROM)
+ * become indices into S->c_table
+ */
+static void
+Spy_threadCode(SpyState* S, const void* const* handlers) {
+	const uint8_t* bytecode = S->bytecode;
+	size_t length = S->bytecode_size;
+	size_t cells = 0;
+
+	/* pass one, find where every instruction starts */
+	S->code_map = (uint32_t *)malloc((length + 1) * sizeof(uint32_t));
+	for (size_t i = 0; i <= length; i++) {
+		S->code_map[i] = SPY_NOCELL;
+	}
+	for (size_t at = 0; at < length;) {
+		const AssemblerInstruction* ins = &instructions[bytecode[at]];
+		if (!ins->name) {
+			Spy_crash(S, "invalid opcode 0x%02x at 0x%zx", bytecode[at], at);
+		}
+		S->code_map[at++] = cells++;
+		for (int i = 0; i < 4 && ins->operands[i] != NO_OPERAND; i++) {
+			at += ins->operands[i] == _INT64 || ins->operands[i] == _FLOAT64 ? 8 : 4;
+			cells++;
+		}
+		if (at > length) {
+			Spy_crash(S, "truncated instruction '%s'", ins->name);
+		}
+	}
+	/* the end of the code is an implicit noop, which terminates */
+	S->code_map[length] = cells++;
+
+	/* pass two, decode */
+	S->code = (SpyCell *)malloc(cells * sizeof(SpyCell));
+	S->code_ops = (uint8_t *)malloc(cells);
+	if (!S->code || !S->code_ops) {
+		Spy_crash(S, "couldn't allocate memory for code\n");
+	}
+	SpyCell* cell = S->code;
+	for (size_t at = 0; at < length;) {
+		const AssemblerInstruction* ins = &instructions[bytecode[at]];
+		S->code_ops[cell - S->code] = bytecode[at];
+		(cell++)->handler = handlers[bytecode[at++]];
+		for (int i = 0; i < 4 && ins->operands[i] != NO_OPERAND; i++) {
+			S->code_ops[cell - S->code] = SPY_OPERAND;
+			switch (ins->operands[i]) {
+				case _INT64:
+					cell->i = *(int64_t *)&bytecode[at];
+					break;
+				case _FLOAT64:
+					cell->f = *(double *)&bytecode[at];
+					break;
+				case _INT32:
+					cell->i = *(uint32_t *)&bytecode[at];
+					break;
+				case _SLOT:
+					cell->i = (int64_t)*(uint32_t *)&bytecode[at] * 8 + 8;
+					break;
+				case _LABEL:
+					cell->target = Spy_codeAt(S, *(uint32_t *)&bytecode[at]);
+					break;
+			}
+			at += ins->operands[i] == _INT64 || ins->operands[i] == _FLOAT64 ? 8 : 4;
+			cell++;
+		}
+	}
+	S->code_ops[cell - S->code] = 0x00;
+	cell->handler = handlers[0x00];
+
+	/* resolve ccalls, every missing function is reported (once) before crashing */
+	int unresolved = 0;
+	for (size_t i = 0; i < cells; i++) {
+		if (S->code_ops[i] != OP_CCALL) continue;
+		uint64_t rom = S->code[i + 1].i;
+		if (rom >= S->rom_size || !memchr(&S->memory[rom], 0, S->rom_size - rom)) {
+			Spy_crash(S, "ccall name at 0x%llx isn't a string in ROM", rom);
+		}
+		const char* identifier = (const char *)&S->memory[rom];
+		int reported = 0;
+		if (Spy_findC(S, identifier) >= 0) continue;
+		for (size_t j = 0; j < i && !reported; j++) {
+			reported = S->code_ops[j] == OP_CCALL && S->code[j + 1].i == S->code[i + 1].i;
+		}
+		if (!reported) {
+			printf("undefined C function '%s'\n", identifier);
+			unresolved++;
+		}
+	}
+	if (unresolved) {
+		Spy_crash(S, "%d C function%s couldn't be resolved", unresolved, unresolved == 1 ? "" : "s");
+	}
+	for (size_t i = 0; i < cells; i++) {
+		if (S->code_ops[i] == OP_CCALL) {
+			S->code[i + 1].i = Spy_findC(S, (const char *)&S->memory[S->code[i + 1].i]);
+		}
+	}
 }
 
+/* bytecode offset of (cell), for errors */
+static size_t
+Spy_offsetOf(const SpyState* S, size_t cell) {
+	size_t offset = 0;
+	while (offset < S->bytecode_size && S->code_map[offset] != cell) {
+		offset++;
+	}
+	return offset;
+}
+
+/* values instruction (op) with (operands) needs on the stack and leaves in
+ * their place, (results) is what a call to its target returns.  the one
+ * table of stack effects, the assembler uses it too.  returns 0 for
+ * instructions that end the path or whose successors aren't known (noop,
+ * returns and computed jumps)
+ */
+int
+Spy_instructionEffect(uint8_t op, const SpyCell* operands, int64_t results, int64_t* pops, int64_t* pushes) {
+	*pops = 0;
+	*pushes = 0;
+	switch (op) {
+		case OP_IPUSH: case OP_FPUSH: case OP_ILLOAD: case OP_FLLOAD:
+		case OP_IARG: case OP_LEA: case OP_ILLADD: case OP_FLLADD:
+		case OP_FLLSUB: case OP_FLLMUL: case OP_ILINC: case OP_ILFIELD:
+		case OP_FLFIELD:
+			*pushes = 1;
+			break;
+		case OP_IADD: case OP_ISUB: case OP_IMUL: case OP_IDIV:
+		case OP_MOD: case OP_SHL: case OP_SHR: case OP_AND:
+		case OP_OR: case OP_XOR: case OP_IGT: case OP_IGE:
+		case OP_ILT: case OP_ILE: case OP_ICMP: case OP_FADD:
+		case OP_FSUB: case OP_FMUL: case OP_FDIV: case OP_FGT:
+		case OP_FGE: case OP_FLT: case OP_FLE: case OP_FCMP:
+		case OP_LOR: case OP_LAND: case OP_PADD: case OP_PSUB:
+		case OP_FMIN: case OP_FMAX: case OP_IMIN: case OP_IMAX:
+			*pops = 2;
+			*pushes = 1;
+			break;
+		case OP_NOT: case OP_NEG: case OP_LNOT: case OP_IDER:
+		case OP_CDER: case OP_FDER: case OP_ILOAD: case OP_ICINC:
+		case OP_ICIDER: case OP_ICFDER: case OP_FSQRT: case OP_FSIN:
+		case OP_FCOS: case OP_FTAN: case OP_FABS: case OP_FFLOOR:
+		case OP_FCEIL: case OP_IABS:
+			*pops = 1;
+			*pushes = 1;
+			break;
+		case OP_FFMA:
+			*pops = 3;
+			*pushes = 1;
+			break;
+		case OP_FTOI: case OP_ITOF:
+			/* converts in place, (operand) values down */
+			*pops = operands[0].i + 1;
+			*pushes = operands[0].i + 1;
+			break;
+		case OP_ILSAVE: case OP_FLSAVE: case OP_JZ: case OP_JNZ:
+		case OP_YIELD:
+			*pops = 1;
+			break;
+		case OP_RESUME: case OP_COSTATUS:
+			*pops = 1;
+			*pushes = 1;
+			break;
+		case OP_COCREATE:
+			*pops = operands[1].i;
+			*pushes = 1;
+			break;
+		case OP_ISAVE: case OP_FSAVE: case OP_ILTJZ: case OP_ILEJZ:
+		case OP_ICMPJZ: case OP_CJNZ: case OP_CJZ:
+			*pops = 2;
+			break;
+		case OP_RES: case OP_ENTER:
+			*pushes = operands[0].i;
+			break;
+		case OP_ILNSAVE:
+			*pops = operands[1].i;
+			break;
+		case OP_MEMCPY: case OP_MEMSET: case OP_MEMMOVE:
+			*pops = 3;
+			break;
+		case OP_VLLOAD:
+			*pushes = 4;
+			break;
+		case OP_VLSAVE:
+			*pops = 4;
+			break;
+		case OP_VLOAD:
+			*pops = 1;
+			*pushes = 4;
+			break;
+		case OP_VSAVE:
+			*pops = 5;
+			break;
+		case OP_VFADD: case OP_VFSUB: case OP_VFMUL: case OP_VFDIV:
+		case OP_VIADD: case OP_VISUB: case OP_VIMUL: case OP_VFCMP:
+		case OP_VICMP:
+			*pops = 8;
+			*pushes = 4;
+			break;
+		case OP_VSELECT:
+			*pops = 12;
+			*pushes = 4;
+			break;
+		case OP_VSPLAT:
+			/* the scalar (operand) values down becomes four lanes */
+			*pops = operands[0].i + 1;
+			*pushes = operands[0].i + 4;
+			break;
+		case OP_VLANE:
+			*pops = 4;
+			*pushes = 1;
+			break;
+		case OP_CALL:
+			*pops = operands[1].i;
+			*pushes = results;
+			break;
+		case OP_CCALL:
+			*pops = operands[1].i;
+			*pushes = operands[2].i;
+			break;
+		case OP_IRET: case OP_FRET:
+			*pops = 1;
+			return 0;
+		case OP_TAILCALL:
+			*pops = operands[1].i;
+			return 0;
+		case OP_CJMP:
+			*pops = 1;
+			return 0;
+		case OP_VRET: case OP_NOOP:
+			return 0;
+	}
+	return 1;
+}
+
+/* Spy_instructionEffect of the threaded instruction at (cell), (results)
+ * is what each function returns by its first cell
+ */
+int
+Spy_stackEffect(const SpyState* S, size_t cell, const uint8_t* results, int64_t* pops, int64_t* pushes) {
+	const SpyCell* operands = &S->code[cell + 1];
+	uint8_t op = S->code_ops[cell];
+	return Spy_instructionEffect(op, operands, op == OP_CALL ? results[operands[0].target - S->code] : 0, pops, pushes);
+}
+
+/* checks everything the interpreter takes on trust, so it never has to
+ * check at runtime.  jump targets and opcodes were checked while threading,
+ * here every frame slot has to be inside the locals its function reserves,
+ * iarg has to be inside the arguments every caller passes and every path
+ * to an instruction has to leave the stack at the same depth, which is
+ * never less than it pops.  functions are the code from each call target
+ * (and the start) to the next one
+ */
+static void
+Spy_verifyCode(SpyState* S) {
+	size_t cells = S->code_map[S->bytecode_size] + 1;
+	uint8_t* is_function = (uint8_t *)calloc(cells, 1);
+	uint8_t* results = (uint8_t *)calloc(cells, 1);
+	uint8_t* costack = (uint8_t *)calloc(cells, 1);
+	uint8_t* queued = (uint8_t *)calloc(cells, 1);
+	int64_t* arguments = (int64_t *)malloc(cells * sizeof(int64_t));
+	int64_t* depth = (int64_t *)malloc(cells * sizeof(int64_t));
+	uint32_t* work = (uint32_t *)malloc(cells * sizeof(uint32_t));
+	if (!is_function || !results || !costack || !queued || !arguments || !depth || !work) {
+		Spy_crash(S, "couldn't allocate memory to verify code\n");
+	}
+
+	/* functions (called or made coroutines), and the fewest arguments each is called with */
+	is_function[0] = 1;
+	arguments[0] = -1; /* the entry frame's arguments are only known at runtime */
+	for (size_t i = 0; i < cells; i++) {
+		depth[i] = -1;
+		if (S->code_ops[i] != OP_CALL && S->code_ops[i] != OP_COCREATE && S->code_ops[i] != OP_TAILCALL) continue;
+		size_t target = S->code[i + 1].target - S->code;
+		if (!is_function[target] || S->code[i + 2].i < arguments[target]) {
+			arguments[target] = S->code[i + 2].i;
+		}
+		is_function[target] = 1;
+	}
+
+	/* a function returns a value if it ever returns with iret or fret, or
+	 * tail calls one that does.  repeated until nothing changes, tail calls
+	 * can reach any function
+	 */
+	for (int changed = 1; changed;) {
+		changed = 0;
+		for (size_t start = 0; start < cells;) {
+			size_t end = start + 1;
+			while (end < cells && !is_function[end]) end++;
+			for (size_t i = start; i < end && !results[start]; i++) {
+				if (S->code_ops[i] == OP_IRET || S->code_ops[i] == OP_FRET
+					|| (S->code_ops[i] == OP_TAILCALL && results[S->code[i + 1].target - S->code])) {
+					results[start] = 1;
+					changed = 1;
+				}
+			}
+			start = end;
+		}
+	}
+
+	/* coroutine stacks are heap blocks without a guard page, so everything
+	 * that can run on one (made a coroutine, or called from something that
+	 * was) needs the checked frame enter gives it
+	 */
+	for (size_t i = 0; i < cells; i++) {
+		if (S->code_ops[i] == OP_COCREATE) {
+			costack[S->code[i + 1].target - S->code] = 1;
+		}
+	}
+	for (int changed = 1; changed;) {
+		changed = 0;
+		for (size_t start = 0; start < cells;) {
+			size_t end = start + 1;
+			while (end < cells && !is_function[end]) end++;
+			for (size_t i = start; i < end && costack[start]; i++) {
+				if (S->code_ops[i] != OP_CALL && S->code_ops[i] != OP_TAILCALL) continue;
+				size_t target = S->code[i + 1].target - S->code;
+				if (!costack[target]) {
+					costack[target] = 1;
+					changed = 1;
+				}
+			}
+			start = end;
+		}
+	}
+
+	for (size_t start = 0; start < cells;) {
+		size_t end = start + 1;
+		while (end < cells && !is_function[end]) end++;
+
+		if (costack[start] && S->code_ops[start] != OP_ENTER) {
+			Spy_crash(S, "function at 0x%zx can run on a coroutine stack but its frame isn't checked (no enter)",
+				Spy_offsetOf(S, start));
+		}
+
+		/* frame slots and arguments */
+		int64_t locals = S->code_ops[start] == OP_RES || S->code_ops[start] == OP_ENTER ? S->code[start + 1].i : 0;
+		for (size_t i = start; i < end; i++) {
+			uint8_t op = S->code_ops[i];
+			if (op == SPY_OPERAND) continue;
+			const AssemblerInstruction* ins = &instructions[op];
+			int64_t last = 0;
+			for (int k = 0; k < 4 && ins->operands[k] != NO_OPERAND; k++) {
+				if (ins->operands[k] == _SLOT && S->code[i + 1 + k].i / 8 > last) {
+					last = S->code[i + 1 + k].i / 8;
+				}
+			}
+			if (op == OP_ILNSAVE || op == OP_ILNLOAD) {
+				last += S->code[i + 2].i - 1;
+			} else if (op == OP_VLLOAD || op == OP_VLSAVE) {
+				last += 3;
+			}
+			if (last > locals) {
+				Spy_crash(S, "%s at 0x%zx uses slot %lld, function only has %lld", 
+					ins->name, Spy_offsetOf(S, i), last - 1, locals);
+			}
+			if ((op == OP_VLANE && (uint64_t)S->code[i + 1].i > 3)
+				|| ((op == OP_VFCMP || op == OP_VICMP) && (uint64_t)S->code[i + 1].i > SPY_VGE)
+				|| (op == OP_VSPLAT && S->code[i + 1].i < 0)) {
+				Spy_crash(S, "%s at 0x%zx has a bad operand (%lld)", ins->name, Spy_offsetOf(S, i), S->code[i + 1].i);
+			}
+			if (op == OP_IARG && arguments[start] >= 0 && S->code[i + 1].i >= arguments[start]) {
+				Spy_crash(S, "iarg at 0x%zx reads argument %lld, function is called with %lld", 
+					Spy_offsetOf(S, i), S->code[i + 1].i, arguments[start]);
+			}
+		}
+
+		/* stack depth above the frame on every path, paths that meet have to
+		 * agree on it so nothing can pop into the frame below or grow the
+		 * stack without bound
+		 */
+		size_t nwork = 0;
+		depth[start] = 0;
+		queued[start] = 1;
+		work[nwork++] = start;
+		while (nwork > 0) {
+			size_t i = work[--nwork];
+			uint8_t op = S->code_ops[i];
+			queued[i] = 0;
+			int64_t pops, pushes;
+			int next = Spy_stackEffect(S, i, results, &pops, &pushes);
+			if (depth[i] < pops) {
+				Spy_crash(S, "%s at 0x%zx pops %lld values, only %lld on the stack", 
+					instructions[op].name, Spy_offsetOf(S, i), pops, depth[i]);
+			}
+			if (!next) continue;
+			size_t successors[2];
+			int nsuccessors = 0;
+			if (op != OP_JMP) {
+				size_t after = i + 1;
+				for (int k = 0; k < 4 && instructions[op].operands[k] != NO_OPERAND; k++) {
+					after++;
+				}
+				successors[nsuccessors++] = after;
+			}
+			if (op == OP_JMP || op == OP_JZ || op == OP_JNZ || op == OP_ILTJZ || op == OP_ILEJZ || op == OP_ICMPJZ) {
+				successors[nsuccessors++] = S->code[i + 1].target - S->code;
+			}
+			for (int k = 0; k < nsuccessors; k++) {
+				size_t s = successors[k];
+				int64_t d = depth[i] - pops + pushes;
+				if (depth[s] >= 0) {
+					if (depth[s] != d) {
+						Spy_crash(S, "paths meet at 0x%zx with %lld and %lld values on the stack",
+							Spy_offsetOf(S, s), depth[s], d);
+					}
+					continue;
+				}
+				depth[s] = d;
+				if (!queued[s]) {
+					queued[s] = 1;
+					work[nwork++] = s;
+				}
+			}
+		}
+
+		start = end;
+	}
+
+	free(is_function);
+	free(results);
+	free(costack);
+	free(queued);
+	free(arguments);
+	free(depth);
+	free(work);
+}
+
+/* timestamp for profiling, in cycles where the cpu has a counter */
+static inline uint64_t
+Spy_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+#if SPY_TOS_CACHE
+/* row of Spy_interpret's stack cached variants for icinc 0, no opcode has it */
+#define SPY_TOS_ICNOP	0xFE
+
+/* gives each instruction in the cells [start, end) that has (variants) the
+ * one for the stack states it's entered and left in, 0 when the top of the
+ * stack is in memory and 1 when it's in the interpreter's tos.  the top is
+ * only kept when an instruction that pushes falls through to one that
+ * pops, anything entered some other way (jump targets, return addresses)
+ * starts in memory.  computed jumps can land anywhere and dbon instruments
+ * the code, so programs using either are left as they are (returns 0)
+ */
+static int
+Spy_cacheStack(SpyState* S, const void* const (*variants)[4], size_t start, size_t end) {
+	size_t cells = S->code_map[S->bytecode_size] + 1;
+	uint8_t* target = (uint8_t *)calloc(cells, 1);
+	if (!target) return 0;
+
+	for (size_t i = 0; i < cells; i++) {
+		uint8_t op = S->code_ops[i];
+		if (op == SPY_OPERAND) continue;
+		if (op == OP_CJMP || op == OP_CJNZ || op == OP_CJZ || op == OP_DBON) {
+			free(target);
+			return 0;
+		}
+		for (int k = 0; k < 4 && instructions[op].operands[k] != NO_OPERAND; k++) {
+			if (instructions[op].operands[k] == _LABEL) {
+				target[S->code[i + 1 + k].target - S->code] = 1;
+			}
+		}
+	}
+
+	int in = 0;
+	for (size_t i = start; i < end;) {
+		uint8_t op = S->code_ops[i];
+		size_t next = i + 1;
+		while (next < cells && S->code_ops[next] == SPY_OPERAND) next++;
+		int out = 0;
+		if (variants[op][0]) {
+			int64_t pops, pushes;
+			Spy_stackEffect(S, i, NULL, &pops, &pushes);
+			if (pushes > 0 && next < end && !target[next] && variants[S->code_ops[next]][0]) {
+				Spy_stackEffect(S, next, NULL, &pops, &pushes);
+				out = pops > 0;
+			}
+			/* icinc 0 leaves the value as it is, see quicken in Spy_interpret */
+			if (op == OP_ICINC && S->code[i + 1].i == 0) {
+				S->code[i].handler = variants[SPY_TOS_ICNOP][in*2 + out];
+			} else {
+				S->code[i].handler = variants[op][in*2 + out];
+			}
+		}
+		in = out;
+		i = next;
+	}
+
+	free(target);
+	return 1;
+}
+#endif
+
+/* handlers Spy_interpret gives tiering (SPY_TIER) */
+typedef struct SpyTierHandlers SpyTierHandlers;
+
+struct SpyTierHandlers {
+	const void* const*		plain;		/* by opcode */
+	const void* const		(*variants)[4];	/* see Spy_cacheStack, NULL if there aren't any */
+	const void*				call;		/* counts calls and tail calls */
+	const void*				loop;		/* counts backward jumps */
+	int						native;		/* hot functions can be compiled */
+};
+
+/* handler of (cell) when its function isn't specialized */
+static const void*
+Spy_tierHandler(const SpyState* S, size_t cell, const SpyTierHandlers* H) {
+	uint8_t op = S->code_ops[cell];
+	if (op == OP_CALL || op == OP_COCREATE || op == OP_TAILCALL) {
+		return H->call;
+	}
+	if (op == OP_JMP && S->code[cell + 1].target <= &S->code[cell]) {
+		return H->loop;
+	}
+	return H->plain[op];
+}
+
+/* splits the code into functions the way SpyJIT_compileAll does, the start
+ * being one too, and has calls and backward jumps counted.  cells that
+ * already have something other than their plain handler (native code,
+ * traced loops) are left alone
+ */
+static void
+Spy_setupTiers(SpyState* S, const SpyTierHandlers* H) {
+	uint32_t cells = S->code_map[S->bytecode_size] + 1;
+	uint8_t* is_function = (uint8_t *)calloc(cells, 1);
+	S->tier_of = (uint32_t *)malloc(cells * sizeof(uint32_t));
+	if (!is_function || !S->tier_of) {
+		Spy_crash(S, "couldn't allocate memory for tiers");
+	}
+	is_function[0] = 1;
+	for (uint32_t i = 0; i < cells; i++) {
+		if (S->code_ops[i] == OP_CALL || S->code_ops[i] == OP_COCREATE || S->code_ops[i] == OP_TAILCALL) {
+			is_function[S->code[i + 1].target - S->code] = 1;
+		}
+	}
+	S->tier_count = 0;
+	for (uint32_t i = 0; i < cells - 1; i++) {
+		S->tier_count += is_function[i];
+	}
+	S->tiers = (SpyTier *)calloc(S->tier_count, sizeof(SpyTier));
+	if (!S->tiers) {
+		Spy_crash(S, "couldn't allocate memory for tiers");
+	}
+
+	/* everything compiled up front is as high as it goes */
+	int compiled = S->jit && (S->option_flags & SPY_JIT);
+	uint64_t first = H->variants ? SPY_TIER_WARM : H->native ? SPY_TIER_HOT : UINT64_MAX;
+	SpyTier* T = NULL;
+	for (uint32_t i = 0; i < cells; i++) {
+		if (i < cells - 1 && is_function[i]) {
+			if (T) T->end = i;
+			T = T ? T + 1 : S->tiers;
+			T->start = i;
+			T->tier = compiled ? SPY_TIER_NATIVE : SPY_TIER_INTERPRETED;
+			T->next = compiled ? UINT64_MAX : first;
+		}
+		S->tier_of[i] = T - S->tiers;
+		if (S->code_ops[i] != SPY_OPERAND && S->code[i].handler == H->plain[S->code_ops[i]]) {
+			S->code[i].handler = Spy_tierHandler(S, i, H);
+		}
+	}
+	T->end = cells - 1;
+	S->tier_clock = Spy_cycles();
+	free(is_function);
+}
+
+/* moves the function (T) up from where it is, to specialized handlers when
+ * it gets warm and to native code when it gets hot.  the interpreter is
+ * about to call it or jump back inside it, at a jump target either way, so
+ * its cells can be given other handlers
+ */
+static void
+Spy_tierUp(SpyState* S, SpyTier* T, const SpyTierHandlers* H) {
+	uint64_t started = Spy_cycles();
+	uint64_t heat = T->calls + T->loops;
+	uint8_t tier = T->tier;
+	if (heat < SPY_TIER_HOT) {
+#if SPY_TOS_CACHE
+		if (H->variants && Spy_cacheStack(S, H->variants, T->start, T->end)) {
+			tier = SPY_TIER_SPECIALIZED;
+		}
+#endif
+	} else if (H->native) {
+		/* native code leaves to the interpreter with the stack in memory */
+		for (uint32_t i = T->start; i < T->end; i++) {
+			if (S->code_ops[i] != SPY_OPERAND) {
+				S->code[i].handler = Spy_tierHandler(S, i, H);
+			}
+		}
+		if (SpyJIT_compileHot(S, T->start, T->end)) {
+			tier = SPY_TIER_NATIVE;
+		} else {
+#if SPY_TOS_CACHE
+			if (T->tier == SPY_TIER_SPECIALIZED) {
+				Spy_cacheStack(S, H->variants, T->start, T->end);
+			}
+#endif
+			Spy_log(S, "JIT buffer full, function at cell %u stays interpreted\n", T->start);
+		}
+	}
+	if (tier != T->tier) {
+		T->tier = tier;
+		T->promoted[tier] = started - S->tier_clock;
+		T->cost[tier] = Spy_cycles() - started;
+	}
+	T->next = H->native && T->tier < SPY_TIER_NATIVE && heat < SPY_TIER_HOT ? SPY_TIER_HOT : UINT64_MAX;
+}
+
+/* prints every function that ran with SPY_TIER, its counters and when it
+ * was promoted
+ */
 void
-Spy_execute(const char* filename, uint32_t option_flags, int argc, char** argv) {
+Spy_dumpTiers(SpyState* S) {
+	static const char* names[] = {"interpreted", "specialized", "native"};
+	if (!S->tiers) {
+		printf("no tiers, the code wasn't prepared with SPY_TIER\n");
+		return;
+	}
+	printf("\n%-10s %12s %12s %-12s %s\n", "function", "calls", "loops", "tier", "promoted (cycles after start, +cycles taken)");
+	for (uint32_t i = 0; i < S->tier_count; i++) {
+		const SpyTier* T = &S->tiers[i];
+		if (!T->calls && !T->loops) continue;
+		printf("0x%-8zx %12llu %12llu %-12s",
+			Spy_offsetOf(S, T->start),
+			(unsigned long long)T->calls,
+			(unsigned long long)T->loops,
+			names[T->tier]
+		);
+		for (int tier = SPY_TIER_SPECIALIZED; tier <= T->tier; tier++) {
+			if (T->promoted[tier]) {
+				printf(" %s at %llu (+%llu)", names[tier], (unsigned long long)T->promoted[tier], (unsigned long long)T->cost[tier]);
+			}
+		}
+		putchar('\n');
+	}
+}
+
+
+/* prints the opcodes that ran, most cycles first, and writes the same as
+ * JSON to (filename).profile.json
+ */
+static void
+Spy_writeProfile(const char* filename, const uint64_t* counts, const uint64_t* cycles) {
+	uint8_t order[0xFF];
+	int n = 0;
+	uint64_t total_count = 0;
+	uint64_t total_cycles = 0;
+	for (int i = 0; i < 0xFF && instructions[i].name; i++) {
+		if (!counts[i]) continue;
+		/* insertion sort, there are less than 0xFF of them */
+		int at = n++;
+		while (at > 0 && cycles[order[at - 1]] < cycles[i]) {
+			order[at] = order[at - 1];
+			at--;
+		}
+		order[at] = i;
+		total_count += counts[i];
+		total_cycles += cycles[i];
+	}
 
-	SpyState S;
-
-	S.memory = (uint8_t *)calloc(1, SIZE_MEMORY);
-	if (!S.memory) {
-		Spy_crash(&S, "couldn't allocate memory\n");
-	}
-	S.ip = NULL; /* to be assigned when code is executed */
-	S.sp = &S.memory[START_STACK + 2]; /* stack grows upwards */
-	S.bp = &S.memory[START_STACK + 2];
-	S.option_flags = option_flags;
-	S.runtime_flags = 0;
-	S.c_functions = NULL;
-	S.memory_chunks = NULL;
-	SpyL_initializeStandardLibrary(&S);
-
-	FILE* f;
-	unsigned long long flen;
-	uint32_t code_start;
-	f = fopen(filename, "rb");
-	if (!f) Spy_crash(&S, "Couldn't open input file '%s'", filename);
+	printf("\n%-10s %14s %16s %10s %7s\n", "opcode", "count", "cycles", "per op", "time");
+	for (int i = 0; i < n; i++) {
+		uint8_t op = order[i];
+		printf("%-10s %14llu %16llu %10.1f %6.2f%%\n",
+			instructions[op].name,
+			(unsigned long long)counts[op],
+			(unsigned long long)cycles[op],
+			(double)cycles[op] / counts[op],
+			total_cycles ? 100.0 * cycles[op] / total_cycles : 0.0
+		);
+	}
+	printf("%-10s %14llu %16llu\n", "total", (unsigned long long)total_count, (unsigned long long)total_cycles);
+
+	char* json_name = (char *)malloc(strlen(filename) + 16);
+	sprintf(json_name, "%s.profile.json", filename);
+	FILE* f = fopen(json_name, "wb");
+	if (!f) {
+		printf("couldn't write profile to '%s'\n", json_name);
+		free(json_name);
+		return;
+	}
+	fprintf(f, "{\n\t\"count\": %llu,\n\t\"cycles\": %llu,\n\t\"opcodes\": [\n",
+		(unsigned long long)total_count, (unsigned long long)total_cycles);
+	for (int i = 0; i < n; i++) {
+		uint8_t op = order[i];
+		fprintf(f, "\t\t{\"name\": \"%s\", \"opcode\": %d, \"count\": %llu, \"cycles\": %llu}%s\n",
+			instructions[op].name,
+			op,
+			(unsigned long long)counts[op],
+			(unsigned long long)cycles[op],
+			i < n - 1 ? "," : ""
+		);
+	}
+	fprintf(f, "\t]\n}\n");
+	fclose(f);
+	printf("profile written to '%s'\n", json_name);
+	free(json_name);
+}
+
+/* points every instruction cell at the instrumented (handler), which
+ * dispatches through the production table itself.  the handlers it
+ * replaces (including JIT entries) are saved and put back by
+ * Spy_uninstrumentCode
+ */
+static void
+Spy_instrumentCode(SpyState* S, const void* handler) {
+	size_t cells = S->code_map[S->bytecode_size] + 1;
+	if (S->saved_handlers) return;
+	S->saved_handlers = (const void **)malloc(cells * sizeof(void *));
+	for (size_t i = 0; i < cells; i++) {
+		if (S->code_ops[i] != SPY_OPERAND) {
+			S->saved_handlers[i] = S->code[i].handler;
+			S->code[i].handler = handler;
+		}
+	}
+}
+
+static void
+Spy_uninstrumentCode(SpyState* S) {
+	size_t cells = S->code_map[S->bytecode_size] + 1;
+	if (!S->saved_handlers) return;
+	for (size_t i = 0; i < cells; i++) {
+		if (S->code_ops[i] != SPY_OPERAND) {
+			S->code[i].handler = S->saved_handlers[i];
+		}
+	}
+	free(S->saved_handlers);
+	S->saved_handlers = NULL;
+}
+
+/* clears everything a run wrote, stack and heap pages that were never
+ * touched aren't mapped yet so the kernel only has to drop the dirty ones.
+ * the loaded program, the C functions and any native code are kept
+ */
+void
+Spy_reset(SpyState* S) {
+	/* ROM and stack, then the heap up to the most the allocator ever gave out,
+	 * the heap stays committed
+	 */
+#ifdef _WIN32
+	memset(S->memory, 0, S->start_heap - SIZE_GUARD);
+	memset(&S->memory[S->start_heap], 0, S->heap_top - S->start_heap);
+#else
+	if (S->mapped) {
+		/* dropping pages of a snapshot would bring back the file, not zeros */
+		mmap(S->memory, S->start_heap - SIZE_GUARD, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+		mmap(&S->memory[S->start_heap], S->heap_committed - S->start_heap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+		S->mapped = 0;
+		S->rom_mapped = 0;
+	} else {
+		madvise(S->memory, S->start_heap - SIZE_GUARD, MADV_DONTNEED);
+		if (S->heap_top > S->start_heap) {
+			madvise(&S->memory[S->start_heap], S->heap_top - S->start_heap, MADV_DONTNEED);
+		}
+	}
+#endif
+	S->heap_top = S->start_heap;
+	if (S->bytecode && !S->rom_mapped) {
+		/* the ROM is still in the file, right before the code (a mapped ROM
+		 * has just gone back to the file's pages)
+		 */
+		memcpy(S->memory, S->bytecode - S->rom_size, S->rom_size);
+	}
+	while (S->memory_chunks) {
+		SpyMemoryChunk* next = S->memory_chunks->next;
+		free(S->memory_chunks);
+		S->memory_chunks = next;
+	}
+	S->ip = NULL;
+	S->sp = &S->memory[S->start_stack + 2]; /* stack grows upwards */
+	S->bp = &S->memory[S->start_stack + 2];
+	S->stack_limit = &S->memory[S->start_heap - SIZE_GUARD];
+	S->coroutine_count = 0;
+	S->coroutine_dead = 0;
+	S->coroutine = 0;
+	S->runtime_flags = 0;
+}
+
+/* frees (S), shared code is left to the state it was shared from */
+void
+Spy_freeState(SpyState* S) {
+	while (S->memory_chunks) {
+		SpyMemoryChunk* next = S->memory_chunks->next;
+		free(S->memory_chunks);
+		S->memory_chunks = next;
+	}
+#ifdef _WIN32
+	VirtualFree(S->memory, 0, MEM_RELEASE);
+#else
+	munmap(S->memory, S->size_memory);
+#endif
+	free(S->saved_handlers);
+	free(S->coroutines);
+	if (!(S->option_flags & SPY_SHARED)) {
+		while (S->c_functions) {
+			SpyCFunction* next = S->c_functions->next;
+			free(S->c_functions);
+			S->c_functions = next;
+		}
+		free(S->c_table);
+		free(S->code);
+		free(S->code_ops);
+		free(S->code_map);
+		if (S->file) {
+#ifdef _WIN32
+			free(S->file);
+#else
+			munmap(S->file, S->file_size);
+#endif
+		}
+		if (S->jit) {
+			SpyJIT_free(S->jit);
+		}
+		free(S->tiers);
+		free(S->tier_of);
+	}
+	free(S);
+}
+
+/* header of a snapshot file, followed by the heap chunks (vm address and
+ * pages of each).  the ROM and stack, then the heap, are stored from the
+ * next SIZE_COMMIT boundaries so they can be mapped straight back
+ */
+typedef struct SpySnapshot {
+	uint32_t		magic;
+	uint32_t		frames;		/* call frames whose bp and ip were made relative */
+	uint64_t		start_stack;
+	uint64_t		start_heap;
+	uint64_t		size_memory;
+	uint64_t		bytecode_size;
+	uint64_t		checksum;	/* of the bytecode, snapshots only fit their program */
+	uint64_t		sp;			/* offsets into memory */
+	uint64_t		bp;
+	uint64_t		ip;			/* cell index */
+	uint64_t		heap_top;
+	uint32_t		runtime_flags;
+	uint32_t		nchunks;
+} SpySnapshot;
+
+#define SPY_SNAPSHOT_MAGIC	0x50414E53
+
+#define ALIGN_COMMIT(n) (((n) + SIZE_COMMIT - 1) & ~(uint64_t)(SIZE_COMMIT - 1))
+
+static uint64_t
+Spy_checksum(const uint8_t* data, size_t length) {
+	uint64_t hash = 0xCBF29CE484222325;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ data[i]) * 0x100000001B3;
+	}
+	return hash;
+}
+
+/* the return address and saved bp of every frame below bp are host pointers,
+ * (relative) turns them into a cell index and a memory offset and back.  the
+ * frame Spy_run builds holds junk, so the walk stops there.  turning them
+ * back stops at a frame that points outside the code or the stack.
+ * RETURN: frames
+ */
+static uint32_t
+Spy_relocateFrames(SpyState* S, uint32_t frames, int relative) {
+	size_t cells = S->code_map[S->bytecode_size] + 1;
+	uint8_t* bp = S->bp;
+	uint32_t n = 0;
+	while (relative ? 1 : n < frames) {
+		const SpyCell** ip = (const SpyCell **)bp;
+		uint8_t** saved = (uint8_t **)(bp - 8);
+		if (relative) {
+			if (*saved < &S->memory[S->start_stack] || *saved >= S->stack_limit) break;
+			if (*ip < S->code || *ip >= &S->code[cells]) {
+				Spy_crash(S, "can't snapshot a call that returns outside the code");
+			}
+			bp = *saved;
+			*ip = (const SpyCell *)(uintptr_t)(*ip - S->code);
+			*saved = (uint8_t *)(uintptr_t)(*saved - S->memory);
+		} else {
+			if (bp - 8 < &S->memory[S->start_stack] || bp + 8 > S->stack_limit) break;
+			if ((uintptr_t)*ip >= cells || (uintptr_t)*saved < S->start_stack || (uintptr_t)*saved >= (uintptr_t)(S->stack_limit - S->memory)) break;
+			*ip = &S->code[(uintptr_t)*ip];
+			*saved = &S->memory[(uintptr_t)*saved];
+			bp = *saved;
+		}
+		n++;
+	}
+	return n;
+}
+
+#ifndef _WIN32
+/* writes the pages of (from) that aren't all zero, the rest are left as holes */
+static int
+Spy_writePages(int fd, uint64_t offset, const uint8_t* from, uint64_t length) {
+	static const uint8_t zero[SIZE_GUARD];
+	for (uint64_t i = 0; i < length; i += SIZE_GUARD) {
+		uint64_t n = length - i < SIZE_GUARD ? length - i : SIZE_GUARD;
+		if (!memcmp(&from[i], zero, n)) continue;
+		if (pwrite(fd, &from[i], n, offset + i) != (ssize_t)n) {
+			return 0;
+		}
+	}
+	return 1;
+}
+#endif
+
+/* saves the running (S) to (filename), for Spy_restore.  call it from a C
+ * function (see snapshot in the standard library), execution carries on
+ * after the ccall.  anything outside VM memory (open files...) isn't saved
+ */
+void
+Spy_snapshot(SpyState* S, const char* filename) {
+#ifdef _WIN32
+	Spy_crash(S, "snapshots aren't supported on this platform");
+#else
+	SpySnapshot header;
+	uint64_t* chunks;
+	uint64_t data, heap_length;
+	int fd, written;
+	if (S->coroutine_count > 0) {
+		Spy_crash(S, "can't snapshot a VM with coroutines");
+	}
+	header.magic = SPY_SNAPSHOT_MAGIC;
+	header.start_stack = S->start_stack;
+	header.start_heap = S->start_heap;
+	header.size_memory = S->size_memory;
+	header.bytecode_size = S->bytecode_size;
+	header.checksum = Spy_checksum(S->bytecode, S->bytecode_size);
+	header.sp = S->sp - S->memory;
+	header.bp = S->bp - S->memory;
+	header.ip = S->ip - S->code;
+	header.heap_top = S->heap_top;
+	header.runtime_flags = S->runtime_flags;
+	header.nchunks = 0;
+	for (SpyMemoryChunk* c = S->memory_chunks; c; c = c->next) {
+		header.nchunks++;
+	}
+	chunks = (uint64_t *)malloc(header.nchunks * 2 * sizeof(uint64_t) + 1);
+	header.nchunks = 0;
+	for (SpyMemoryChunk* c = S->memory_chunks; c; c = c->next) {
+		chunks[header.nchunks * 2] = c->vm_address;
+		chunks[header.nchunks * 2 + 1] = c->pages;
+		header.nchunks++;
+	}
+	data = ALIGN_COMMIT(sizeof(SpySnapshot) + header.nchunks * 2 * sizeof(uint64_t));
+	heap_length = ALIGN_COMMIT(S->heap_top - S->start_heap);
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		Spy_crash(S, "couldn't write snapshot '%s'", filename);
+	}
+	header.frames = Spy_relocateFrames(S, 0, 1);
+	written = pwrite(fd, &header, sizeof(SpySnapshot), 0) == sizeof(SpySnapshot)
+		&& pwrite(fd, chunks, header.nchunks * 2 * sizeof(uint64_t), sizeof(SpySnapshot)) == (ssize_t)(header.nchunks * 2 * sizeof(uint64_t))
+		&& Spy_writePages(fd, data, S->memory, S->start_heap - SIZE_GUARD)
+		&& Spy_writePages(fd, data + ALIGN_COMMIT(S->start_heap), &S->memory[S->start_heap], heap_length)
+		&& !ftruncate(fd, data + ALIGN_COMMIT(S->start_heap) + heap_length);
+	Spy_relocateFrames(S, header.frames, 0);
+	close(fd);
+	free(chunks);
+	if (!written) {
+		Spy_crash(S, "couldn't write snapshot '%s'", filename);
+	}
+#endif
+}
+
+/* maps a snapshot of the program loaded in (S) back into its memory, copy
+ * on write, so Spy_resume carries on from the snapshot() that took it (which
+ * returns 1 this time)
+ */
+void
+Spy_restore(SpyState* S, const char* filename) {
+#ifdef _WIN32
+	Spy_crash(S, "snapshots aren't supported on this platform");
+#else
+	SpySnapshot header;
+	uint64_t* chunks;
+	uint64_t data, heap_length, stack_end;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0 || pread(fd, &header, sizeof(SpySnapshot), 0) != sizeof(SpySnapshot) || header.magic != SPY_SNAPSHOT_MAGIC) {
+		Spy_crash(S, "'%s' isn't a snapshot", filename);
+	}
+	if (header.start_stack != S->start_stack || header.start_heap != S->start_heap || header.size_memory != S->size_memory) {
+		Spy_crash(S, "snapshot '%s' was taken with different memory sizes", filename);
+	}
+	if (!S->bytecode || header.bytecode_size != S->bytecode_size || header.checksum != Spy_checksum(S->bytecode, S->bytecode_size)) {
+		Spy_crash(S, "snapshot '%s' was taken of another program", filename);
+	}
+	if (!S->code) {
+		Spy_prepare(S);
+	}
+	S->stack_limit = &S->memory[S->start_heap - SIZE_GUARD];
+	stack_end = S->stack_limit - S->memory;
+	if (header.ip > S->code_map[S->bytecode_size] || header.heap_top < S->start_heap || header.heap_top > S->size_memory
+		|| header.sp < S->start_stack || header.sp >= stack_end || header.bp < S->start_stack || header.bp >= stack_end) {
+		Spy_crash(S, "corrupt snapshot '%s'", filename);
+	}
+	/* chunks are in address order and inside the heap, as SpyL_malloc keeps them */
+	chunks = (uint64_t *)malloc(header.nchunks * 2 * sizeof(uint64_t) + 1);
+	if (!chunks || pread(fd, chunks, header.nchunks * 2 * sizeof(uint64_t), sizeof(SpySnapshot)) != (ssize_t)(header.nchunks * 2 * sizeof(uint64_t))) {
+		Spy_crash(S, "corrupt snapshot '%s'", filename);
+	}
+	for (uint64_t i = 0, end = S->start_heap; i < header.nchunks; i++) {
+		if (chunks[i * 2] < end || chunks[i * 2] > header.heap_top || chunks[i * 2 + 1] > (header.heap_top - chunks[i * 2]) / SIZE_PAGE) {
+			Spy_crash(S, "corrupt snapshot '%s'", filename);
+		}
+		end = chunks[i * 2] + chunks[i * 2 + 1] * SIZE_PAGE;
+	}
+	data = ALIGN_COMMIT(sizeof(SpySnapshot) + header.nchunks * 2 * sizeof(uint64_t));
+	heap_length = ALIGN_COMMIT(header.heap_top - S->start_heap);
+
+	/* memory, whatever the heap had committed beyond the snapshot is cleared */
+	if (mmap(S->memory, S->start_heap - SIZE_GUARD, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, data) == MAP_FAILED
+		|| (heap_length && mmap(&S->memory[S->start_heap], heap_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, data + ALIGN_COMMIT(S->start_heap)) == MAP_FAILED)) {
+		Spy_crash(S, "couldn't map snapshot '%s'", filename);
+	}
+	close(fd);
+	if (S->heap_committed > S->start_heap + heap_length) {
+		madvise(&S->memory[S->start_heap + heap_length], S->heap_committed - S->start_heap - heap_length, MADV_DONTNEED);
+	} else {
+		S->heap_committed = S->start_heap + heap_length;
+	}
+	S->heap_top = header.heap_top;
+	S->mapped = 1;
+	S->rom_mapped = 0;
+
+	while (S->memory_chunks) {
+		SpyMemoryChunk* next = S->memory_chunks->next;
+		free(S->memory_chunks);
+		S->memory_chunks = next;
+	}
+	SpyMemoryChunk* tail = NULL;
+	for (uint32_t i = 0; i < header.nchunks; i++) {
+		SpyMemoryChunk* chunk = (SpyMemoryChunk *)malloc(sizeof(SpyMemoryChunk));
+		chunk->vm_address = chunks[i * 2];
+		chunk->pages = chunks[i * 2 + 1];
+		chunk->absolute_address = &S->memory[chunk->vm_address];
+		chunk->next = NULL;
+		chunk->prev = tail;
+		if (tail) {
+			tail->next = chunk;
+		} else {
+			S->memory_chunks = chunk;
+		}
+		tail = chunk;
+	}
+	free(chunks);
+
+	S->sp = &S->memory[header.sp];
+	S->bp = &S->memory[header.bp];
+	S->ip = &S->code[header.ip];
+	S->coroutine_count = 0;
+	S->coroutine_dead = 0;
+	S->coroutine = 0;
+	S->runtime_flags = header.runtime_flags;
+	if (Spy_relocateFrames(S, header.frames, 0) != header.frames) {
+		Spy_crash(S, "corrupt snapshot '%s'", filename);
+	}
+	Spy_pushInt(S, 1);
+#endif
+}
+
+/* maps a bytecode file into (S) read-only, its ROM is mapped (copy on
+ * write) at the bottom of memory when it's page aligned in the file, and
+ * copied when not.  the code is threaded by the first Spy_run
+ */
+void
+Spy_load(SpyState* S, const char* filename) {
+	uint64_t flen;
+	uint32_t rom_start, code_start;
+	uint8_t* contents;
+#ifdef _WIN32
+	FILE* f = fopen(filename, "rb");
+	if (!f) Spy_crash(S, "Couldn't open input file '%s'", filename);
 	fseek(f, 0, SEEK_END);
 	flen = ftell(f);
 	fseek(f, 0, SEEK_SET);
-	S.bytecode = (uint8_t *)malloc(flen + 1);
-	fread(S.bytecode, 1, flen, f);
-	S.bytecode[flen] = 0;
+	contents = (uint8_t *)malloc(flen + 1);
+	fread(contents, 1, flen, f);
 	fclose(f);
-	
-	for (int i = 12; i < *(uint32_t *)&S.bytecode[8]; i++) {
-		S.memory[i - 12] = S.bytecode[i];
+#else
+	struct stat info;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) Spy_crash(S, "Couldn't open input file '%s'", filename);
+	fstat(fd, &info);
+	flen = info.st_size;
+	if (flen < SIZE_HEADER) {
+		Spy_crash(S, "'%s' isn't a spyre bytecode file", filename);
+	}
+	contents = mmap(NULL, flen, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (contents == MAP_FAILED) {
+		Spy_crash(S, "couldn't map '%s'", filename);
 	}
+#endif
 
-	/* prepare instruction pointer, point it to code */	
-	S.bytecode = &S.bytecode[*(uint32_t *)&S.bytecode[8]];
-	S.ip = S.bytecode;
+	/* the header is trusted from here on, so check it before anything is copied */
+	if (flen < SIZE_HEADER || *(uint32_t *)&contents[0] != SPY_MAGIC) {
+		Spy_crash(S, "'%s' isn't a spyre bytecode file", filename);
+	}
+	/* files from before the ROM was aligned have 8 here, and the ROM right after the header */
+	if (*(uint32_t *)&contents[4] == 8) {
+		Spy_crash(S, "'%s' is from an old version of spyre, rebuild it with spy a", filename);
+	}
+	if (*(uint32_t *)&contents[12] != SPY_FORMAT) {
+		Spy_crash(S, "'%s' was built for another version of spyre, rebuild it with spy a", filename);
+	}
+	rom_start = *(uint32_t *)&contents[4];
+	code_start = *(uint32_t *)&contents[8];
+	if (rom_start < SIZE_HEADER || code_start < rom_start || code_start > flen) {
+		Spy_crash(S, "corrupt header in '%s'", filename);
+	}
+	if (code_start - rom_start > S->start_stack) {
+		Spy_crash(S, "ROM of '%s' doesn't fit in memory", filename);
+	}
+	S->file = contents;
+	S->file_size = flen;
+	S->rom_size = code_start - rom_start;
+	S->rom_mapped = 0;
+#ifndef _WIN32
+	if (S->rom_size > 0 && rom_start % sysconf(_SC_PAGESIZE) == 0) {
+		S->rom_mapped = mmap(S->memory, S->rom_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, rom_start) != MAP_FAILED;
+	}
+	close(fd);
+#endif
+	if (!S->rom_mapped) {
+		memcpy(S->memory, &contents[rom_start], S->rom_size);
+	}
 
-	/* push command line arguments */
-	for (int i = argc - 1; i >= 0; i--) {
-		Spy_pushInt(&S, strlen(argv[i]));
-		SpyL_malloc(&S);
-		/* allocated space for the string, now find tail of malloc blocks */
-		SpyMemoryChunk* chunk = S.memory_chunks;
-		while (chunk->next) chunk = chunk->next;
-		strcpy((char *)chunk->absolute_address, argv[i]);
+	/* find the code, it's threaded once the handlers are known (see Spy_run) */
+	S->bytecode_size = flen - code_start;
+	S->bytecode = &contents[code_start];
+	S->filename = filename;
+}
+
+/* loads a ROM without any code, for programs compiled ahead of time (see
+ * aot.c) that only use the runtime
+ */
+void
+Spy_loadROM(SpyState* S, const uint8_t* rom, size_t size, const char* filename) {
+	if (size > S->start_stack) {
+		Spy_crash(S, "ROM of '%s' doesn't fit in memory", filename);
 	}
+	memcpy(S->memory, rom, size);
+	S->rom_size = size;
+	S->filename = filename;
+}
+
+/* entries for Spy_interpret that aren't bytecode offsets */
+#define SPY_PREPARE		-1	/* only thread the code */
+#define SPY_CONTINUE	-2	/* carry on from S->ip */
 
-	/* push ng */
-	Spy_pushInt(&S, argc);
+/* interprets (state) from the instruction at bytecode offset (entry) until
+ * it reaches a noop, the code is threaded the first time
+ */
+static void
+Spy_interpret(SpyState* state, int64_t entry) {
 
-	/* push junk for ng, ip, and bp onto the stack to maintain alignment for arg instruction */
-	Spy_pushInt(&S, 0x7369DB6469766164);
-	Spy_pushInt(&S, 0xDB6C6F6F63DB61DB);
-	Spy_pushInt(&S, 0x212121212164696B);
-	/* assign BP to SP to simulate a function call */
-	S.bp = S.sp;
+	/* interpreted with a local copy, written back when the program ends */
+	SpyState S = *state;
+	uint32_t option_flags = S.option_flags;
+
+	/* stack overflows in this thread hit this state's guard page */
+	guard_page = &S.memory[S.start_heap - SIZE_GUARD];
 
 	/* general purpose vars for interpretation */
 	int64_t a, c;
 	double b, d;
 	uint8_t *pa, *pb;
+	const SpyCell* pc;
+	const void* quick;
+
+#if SPY_TOS_CACHE
+	/* top of the stack, between instructions left in state 1 */
+	int64_t tos = 0;
+
+	/* variants of each instruction by the state it's entered and left in,
+	 * [in*2 + out], see Spy_cacheStack
+	 */
+	#define SPY_TOS_VARIANTS(name) {&&name##_00, &&name##_01, &&name##_10, &&name##_11}
+	static const void* const variants[0x100][4] = {
+		[OP_IPUSH] = SPY_TOS_VARIANTS(ipush), [OP_FPUSH] = SPY_TOS_VARIANTS(fpush),
+		[OP_ILLOAD] = SPY_TOS_VARIANTS(ilload), [OP_FLLOAD] = SPY_TOS_VARIANTS(flload),
+		[OP_ILSAVE] = SPY_TOS_VARIANTS(ilsave), [OP_FLSAVE] = SPY_TOS_VARIANTS(flsave),
+		[OP_IARG] = SPY_TOS_VARIANTS(iarg), [OP_LEA] = SPY_TOS_VARIANTS(lea),
+		[OP_IADD] = SPY_TOS_VARIANTS(iadd), [OP_ISUB] = SPY_TOS_VARIANTS(isub),
+		[OP_IMUL] = SPY_TOS_VARIANTS(imul), [OP_AND] = SPY_TOS_VARIANTS(and),
+		[OP_OR] = SPY_TOS_VARIANTS(or), [OP_XOR] = SPY_TOS_VARIANTS(xor),
+		[OP_NOT] = SPY_TOS_VARIANTS(not), [OP_NEG] = SPY_TOS_VARIANTS(neg),
+		[OP_IGT] = SPY_TOS_VARIANTS(igt), [OP_IGE] = SPY_TOS_VARIANTS(ige),
+		[OP_ILT] = SPY_TOS_VARIANTS(ilt), [OP_ILE] = SPY_TOS_VARIANTS(ile),
+		[OP_ICMP] = SPY_TOS_VARIANTS(icmp), [OP_LOR] = SPY_TOS_VARIANTS(lor),
+		[OP_LAND] = SPY_TOS_VARIANTS(land), [OP_LNOT] = SPY_TOS_VARIANTS(lnot),
+		[OP_PADD] = SPY_TOS_VARIANTS(padd), [OP_PSUB] = SPY_TOS_VARIANTS(psub),
+		[OP_FADD] = SPY_TOS_VARIANTS(fadd), [OP_FSUB] = SPY_TOS_VARIANTS(fsub),
+		[OP_FMUL] = SPY_TOS_VARIANTS(fmul), [OP_FDIV] = SPY_TOS_VARIANTS(fdiv),
+		[OP_FGT] = SPY_TOS_VARIANTS(fgt), [OP_FGE] = SPY_TOS_VARIANTS(fge),
+		[OP_FLT] = SPY_TOS_VARIANTS(flt), [OP_FLE] = SPY_TOS_VARIANTS(fle),
+		[OP_FCMP] = SPY_TOS_VARIANTS(fcmp), [OP_IDER] = SPY_TOS_VARIANTS(ider),
+		[OP_FDER] = SPY_TOS_VARIANTS(fder), [OP_CDER] = SPY_TOS_VARIANTS(cder),
+		[OP_ILOAD] = SPY_TOS_VARIANTS(iload), [OP_ISAVE] = SPY_TOS_VARIANTS(isave),
+		[OP_FSAVE] = SPY_TOS_VARIANTS(fsave), [OP_ICINC] = SPY_TOS_VARIANTS(icinc),
+		[OP_ILLADD] = SPY_TOS_VARIANTS(illadd), [OP_FLLADD] = SPY_TOS_VARIANTS(flladd),
+		[OP_FLLSUB] = SPY_TOS_VARIANTS(fllsub), [OP_FLLMUL] = SPY_TOS_VARIANTS(fllmul),
+		[OP_ILINC] = SPY_TOS_VARIANTS(ilinc), [OP_ILFIELD] = SPY_TOS_VARIANTS(ilfield),
+		[OP_FLFIELD] = SPY_TOS_VARIANTS(flfield), [OP_ICIDER] = SPY_TOS_VARIANTS(icider),
+		[OP_ICFDER] = SPY_TOS_VARIANTS(icfder), [OP_JZ] = SPY_TOS_VARIANTS(jz),
+		[OP_JNZ] = SPY_TOS_VARIANTS(jnz), [OP_ILTJZ] = SPY_TOS_VARIANTS(iltjz),
+		[OP_ILEJZ] = SPY_TOS_VARIANTS(ilejz), [OP_ICMPJZ] = SPY_TOS_VARIANTS(icmpjz),
+		[SPY_TOS_ICNOP] = SPY_TOS_VARIANTS(icnop)
+	};
+	#undef SPY_TOS_VARIANTS
+#endif
 
 	/* IP saver */
-	uint8_t ipsave = 0;
+	const SpyCell* ipsave = NULL;
 
 	/* pointers to labels, (direct threading, significantly faster than switch/case) */
 	static const void* opcodes[] = {
@@ -259,30 +1876,171 @@ Spy_execute(const char* filename, uint32_t option_flags, int argc, char** argv)
 		&&vret, &&dbon, &&dboff, &&dbds, &&cjnz,
 		&&cjz, &&cjmp, &&ilnsave, &&ilnload,
 		&&flload, &&flsave, &&ftoi, &&itof,
-		&&fder, &&fsave, &&lnot
+		&&fder, &&fsave, &&lnot, &&riset,
+		&&rfset, &&rmov, &&riadd, &&risub,
+		&&rimul, &&ridiv, &&rfadd, &&rfsub,
+		&&rfmul, &&rfdiv, &&illadd, &&flladd,
+		&&fllsub, &&fllmul, &&ilinc, &&ilfield,
+		&&flfield, &&icider, &&icfder, &&riaddi,
+		&&iltjz, &&ilejz, &&icmpjz, &&enter,
+		&&cocreate, &&resume, &&yield, &&costatus,
+		&&tailcall, &&memcpy, &&memset, &&memmove,
+		&&vlload, &&vlsave, &&vload, &&vsave,
+		&&vfadd, &&vfsub, &&vfmul, &&vfdiv,
+		&&viadd, &&visub, &&vimul, &&vfcmp,
+		&&vicmp, &&vselect, &&vsplat, &&vlane,
+		&&fsqrt, &&fsin, &&fcos, &&ftan,
+		&&fabs, &&ffloor, &&fceil, &&fmin,
+		&&fmax, &&ffma, &&imin, &&imax,
+		&&iabs
 	};
 
+	/* return address of every coroutine's function */
+	static const SpyCell coroutine_exit[] = {{&&coreturn}};
+
+	/* SPY_TIER, functions are specialized when they get warm and compiled
+	 * when they get hot.  loops are traced instead with SPY_TRACE and
+	 * everything is compiled up front with SPY_JIT
+	 */
+	SpyTierHandlers tier_handlers = {opcodes, NULL, &&tier_call, &&tier_loop, 0};
+#if SPY_TOS_CACHE
+	if (!(option_flags & (SPY_JIT | SPY_TRACE))) {
+		tier_handlers.variants = variants;
+	}
+#endif
+
+	/* prepare the code the first time the program runs */
+	if (!S.code) {
+		Spy_threadCode(&S, opcodes);
+		Spy_verifyCode(&S);
+
+#if SPY_TOS_CACHE
+		/* every instruction has to be the plain one when the code is instrumented or
+		 * compiled, with SPY_TIER functions are specialized as they get warm
+		 */
+		if (!(option_flags & (SPY_DEBUG | SPY_STEP | SPY_PROFILE | SPY_JIT | SPY_TRACE | SPY_TIER))) {
+			Spy_cacheStack(&S, variants, 0, S.code_map[S.bytecode_size] + 1);
+		}
+#endif
+
+		/* native code can't be instrumented, so debugging and profiling stay interpreted */
+		if (option_flags & (SPY_JIT | SPY_TRACE | SPY_TIER) && !(option_flags & (SPY_DEBUG | SPY_STEP | SPY_PROFILE)) && SpyJIT_available()) {
+			SpyJIT_init(&S, &&jit_enter, &&jit_loop, &&jit_record);
+			if (option_flags & SPY_JIT) {
+				SpyJIT_compileAll(&S);
+			}
+		}
+	}
+
+	/* counters are kept by handlers, which instrumenting replaces */
+	tier_handlers.native = S.jit && !(option_flags & (SPY_JIT | SPY_TRACE));
+	if (option_flags & SPY_TIER && !S.tiers && !(option_flags & (SPY_DEBUG | SPY_STEP | SPY_PROFILE))) {
+		Spy_setupTiers(&S, &tier_handlers);
+	}
+	if (entry == SPY_PREPARE) {
+		*state = S;
+		return;
+	}
+	if (entry != SPY_CONTINUE) {
+		S.ip = Spy_codeAt(&S, entry);
+	}
+
+	/* instructions executed while instrumented */
 	int total = 0;
 
-	/* main interpreter loop */
+	/* SPY_PROFILE, cycles are charged to the last instruction dispatched */
+	uint64_t profile_counts[0xFF] = {0};
+	uint64_t profile_cycles[0xFF] = {0};
+	uint64_t profile_last = Spy_cycles();
+
+	if (option_flags & (SPY_DEBUG | SPY_STEP | SPY_PROFILE)) {
+		Spy_instrumentCode(&S, &&instrumented);
+	}
+
+	/* main interpreter loop, nothing but the jump when not instrumented */
 	dispatch:
+	goto *(S.ip++)->handler;
+
+	/* handler of every cell while debugging (see dbon/dboff) */
+	instrumented:
 	total++;
-	if (S.sp >= &S.memory[START_HEAP]) {
-		Spy_crash(&S, "stack overflow");
+	if (option_flags & SPY_PROFILE) {
+		uint64_t now = Spy_cycles();
+		if (ipsave) {
+			profile_cycles[S.code_ops[ipsave - S.code]] += now - profile_last;
+		}
+		profile_counts[S.code_ops[S.ip - 1 - S.code]]++;
+		profile_last = now;
 	}
 	if (option_flags & SPY_STEP && option_flags & SPY_DEBUG) {
 		for (int i = 0; i < 100; i++) {
 			fputc('\n', stdout);
 		}
 		Spy_dumpStack(&S);
-		printf("\nexecuted %s\n", instructions[ipsave].name);
+		if (ipsave) {
+			printf("\nexecuted %s\n", instructions[S.code_ops[ipsave - S.code]].name);
+		}
 		getchar();
 	}
-	ipsave = *S.ip;
-	goto *opcodes[*S.ip++];
+	ipsave = S.ip - 1;
+	goto *opcodes[S.code_ops[ipsave - S.code]];
+
+	/* quickening, the first time an instruction runs its cell is given
+	 * (quick), a handler specialized for its operands, and runs that.  only
+	 * plain handlers are replaced, anything else in the cell (instrumented,
+	 * stack cached, native code, recording) stays, and shared code is never
+	 * patched.  code_ops keeps the instruction so everything reading the
+	 * code sees it as it was
+	 */
+	quicken:
+	c = S.ip - 1 - S.code;
+	if (!(option_flags & SPY_SHARED) && S.code[c].handler == opcodes[S.code_ops[c]]) {
+		S.code[c].handler = quick;
+	}
+	goto *quick;
 
 	noop:
 	goto done;
+
+	/* handler of cells that have native code, not an opcode */
+	jit_enter:
+	S.ip = S.jit->enter(&S, S.jit->entries[S.ip - 1 - S.code]);
+	goto dispatch;
+
+	/* backward jmp, traces the loop once it's hot */
+	jit_loop:
+	pc = Spy_readTarget(&S);
+	if (++S.jit->counts[S.ip - 2 - S.code] == SPY_JIT_HOTLOOP) {
+		SpyJIT_startTrace(&S, pc, S.ip - 2);
+	}
+	S.ip = pc;
+	goto dispatch;
+
+	/* cells of a loop that is being traced */
+	jit_record:
+	goto *SpyJIT_record(&S, S.ip - 1);
+
+	/* call or tailcall with SPY_TIER, counts the call then makes it */
+	tier_call:
+	{
+		SpyTier* T = &S.tiers[S.tier_of[S.ip->target - S.code]];
+		if (++T->calls + T->loops >= T->next) {
+			Spy_tierUp(&S, T, &tier_handlers);
+		}
+	}
+	goto *opcodes[S.code_ops[S.ip - 1 - S.code]];
+
+	/* backward jmp with SPY_TIER */
+	tier_loop:
+	pc = Spy_readTarget(&S);
+	{
+		SpyTier* T = &S.tiers[S.tier_of[S.ip - 2 - S.code]];
+		if (++T->loops + T->calls >= T->next) {
+			Spy_tierUp(&S, T, &tier_handlers);
+		}
+	}
+	S.ip = pc;
+	goto dispatch;
 	
 	ipush:
 	Spy_pushInt(&S, Spy_readInt64(&S));
@@ -369,75 +2127,98 @@ Spy_execute(const char* filename, uint32_t option_flags, int argc, char** argv)
 	goto dispatch;
 
 	jnz:
-	a = Spy_readInt32(&S);
+	pc = Spy_readTarget(&S);
 	if (Spy_popInt(&S)) {
-		S.ip = (uint8_t *)&S.bytecode[a];
+		S.ip = pc;
 	}
 	goto dispatch;
 
 	jz:
-	a = Spy_readInt32(&S);
+	pc = Spy_readTarget(&S);
 	if (!Spy_popInt(&S)) {
-		S.ip = (uint8_t *)&S.bytecode[a];
+		S.ip = pc;
 	}
 	goto dispatch;
 
 	jmp:
-	S.ip = (uint8_t *)&S.bytecode[Spy_readInt32(&S)];
+	S.ip = Spy_readTarget(&S);
 	goto dispatch;
 
 	call:
 	{
-		a = Spy_readInt32(&S);
+		/* arguments stay in push order, iarg indices count from the last */
+		pc = Spy_readTarget(&S);
 		uint32_t num_args = Spy_readInt32(&S);
-		int64_t* pops = malloc(num_args * 8);
-		/* flip the arguments */
-		for (int i = 0; i < num_args; i++) {
-			pops[i] = *(int64_t *)Spy_popRaw(&S);
-		}
-		for (int i = 0; i < num_args; i++) {
-			Spy_pushInt(&S, pops[i]);
-		}
-		free(pops);
 		Spy_pushInt(&S, num_args); /* push number of arguments */
 		Spy_pushPointer(&S, (void *)S.bp); /* push base pointer */
 		Spy_pushPointer(&S, (void *)S.ip); /* push return address */
 		S.bp = S.sp;
-		S.ip = (uint8_t *)&S.bytecode[a];
+		S.ip = pc;
+	}
+	goto dispatch;
+
+	tailcall:
+	{
+		/* the arguments replace the caller's and the frame is built again
+		 * in the same place, so the callee returns where the caller would have
+		 */
+		pc = Spy_readTarget(&S);
+		uint32_t num_args = Spy_readInt32(&S);
+		const SpyCell* ret = *(const SpyCell **)S.bp;
+		uint8_t* saved_bp = *(uint8_t **)(S.bp - 8);
+		uint8_t* base = S.bp - 16 - *(int64_t *)(S.bp - 16) * 8;
+		memmove(base, S.sp + 8 - num_args * 8, num_args * 8);
+		S.sp = base + num_args * 8 - 8;
+		Spy_pushInt(&S, num_args);
+		Spy_pushPointer(&S, (void *)saved_bp);
+		Spy_pushPointer(&S, (void *)ret);
+		S.bp = S.sp;
+		S.ip = pc;
 	}
 	goto dispatch;
 
 	iret:
 	a = Spy_popInt(&S); /* return value */
 	S.sp = S.bp;
-	S.ip = (uint8_t *)Spy_popPointer(&S);	
+	S.ip = (const SpyCell *)Spy_popPointer(&S);	
 	S.bp = (uint8_t *)Spy_popPointer(&S);
 	S.sp -= Spy_popInt(&S) * 8;
 	Spy_pushInt(&S, a);
 	goto dispatch;	
 
 	ccall:
+	quick = S.ip[1].i <= 1 ? &&ccall_direct : S.ip[1].i == 2 ? &&ccall_swap : &&ccall_flip;
+	goto quicken;
+
+	/* flip the arguments in place, C functions pop the first one first */
+	ccall_flip:
 	{
-		uint32_t name_index = Spy_readInt32(&S);
+		uint32_t function_index = Spy_readInt32(&S);
 		uint32_t num_args = Spy_readInt32(&S);
-		int64_t* pops = malloc(num_args * 8);
-		/* flip the arguments */
-		for (int i = 0; i < num_args; i++) {
-			pops[i] = *(int64_t *)Spy_popRaw(&S);
-		}
-		for (int i = 0; i < num_args; i++) {
-			Spy_pushInt(&S, pops[i]);
-		}
-		free(pops);
-		SpyCFunction* cf = S.c_functions;
-		while (cf && strcmp(cf->identifier, (const char *)&S.memory[name_index])) cf = cf->next;
-		if (!cf) {
-			printf("%d\n", name_index);
-			Spy_crash(&S, "Attempt to call undefined C function '%s'\n", &S.memory[name_index]);
+		Spy_readInt32(&S); /* number of results, for the assembler */
+		int64_t* low = (int64_t *)(S.sp - (num_args - 1) * 8);
+		int64_t* high = (int64_t *)S.sp;
+		while (low < high) {
+			int64_t swap = *low;
+			*low++ = *high;
+			*high-- = swap;
 		}
-		cf->function(&S);
+		S.c_table[function_index](&S);
 	}
 	goto dispatch;
+
+	ccall_swap:
+	a = *(int64_t *)S.sp;
+	*(int64_t *)S.sp = *(int64_t *)(S.sp - 8);
+	*(int64_t *)(S.sp - 8) = a;
+	/* fallthrough */
+
+	/* no arguments or one, nothing to flip */
+	ccall_direct:
+	pc = S.ip;
+	S.ip += 3;
+	S.c_table[pc->i](&S);
+	goto dispatch;
 		
 	fpush:
 	Spy_pushFloat(&S, Spy_readFloat(&S));
@@ -488,18 +2269,18 @@ Spy_execute(const char* filename, uint32_t option_flags, int argc, char** argv)
 	fret:
 	b = Spy_popFloat(&S); /* return value */
 	S.sp = S.bp;
-	S.ip = (uint8_t *)Spy_popPointer(&S);	
+	S.ip = (const SpyCell *)Spy_popPointer(&S);	
 	S.bp = (uint8_t *)Spy_popPointer(&S);
 	S.sp -= Spy_popInt(&S);
 	Spy_pushFloat(&S, a);
 	goto dispatch;	
 
 	ilload:
-	Spy_pushInt(&S, *(int64_t *)&S.bp[Spy_readInt32(&S)*8 + 8]);
+	Spy_pushInt(&S, *(int64_t *)Spy_readLocal(&S));
 	goto dispatch;
 
 	ilsave:
-	Spy_saveInt(&S, &S.bp[Spy_readInt32(&S)*8 + 8], Spy_popInt(&S));
+	Spy_saveInt(&S, Spy_readLocal(&S), Spy_popInt(&S));
 	goto dispatch;
 
 	iarg:
@@ -519,8 +2300,16 @@ Spy_execute(const char* filename, uint32_t option_flags, int argc, char** argv)
 	S.sp += Spy_readInt32(&S) * 8;
 	goto dispatch;
 
+	/* res, and check the deepest the function's stack can get */
+	enter:
+	S.sp += Spy_readInt32(&S) * 8;
+	if (S.sp + Spy_readInt32(&S) * 8 >= S.stack_limit) {
+		Spy_crash(&S, "stack overflow");
+	}
+	goto dispatch;
+
 	lea:
-	Spy_pushPointer(&S, (void *)(&S.bp[Spy_readInt32(&S)*8 + 8] - S.memory));
+	Spy_pushPointer(&S, (void *)(Spy_readLocal(&S) - S.memory));
 	goto dispatch;
 
 	ider:
@@ -528,9 +2317,17 @@ Spy_execute(const char* filename, uint32_t option_flags, int argc, char** argv)
 	goto dispatch;
 
 	icinc:
+	quick = S.ip->i ? &&icinc_add : &&icinc_nop;
+	goto quicken;
+
+	icinc_add:
 	Spy_pushInt(&S, Spy_popInt(&S) + Spy_readInt64(&S));
 	goto dispatch;
 
+	icinc_nop:
+	S.ip++;
+	goto dispatch;
+
 	cder:
 	Spy_pushInt(&S, *(uint8_t *)&S.memory[Spy_popInt(&S)]);
 	goto dispatch;
@@ -561,18 +2358,23 @@ Spy_execute(const char* filename, uint32_t option_flags, int argc, char** argv)
 
 	vret:
 	S.sp = S.bp;
-	S.ip = (uint8_t *)Spy_popPointer(&S);	
+	S.ip = (const SpyCell *)Spy_popPointer(&S);	
 	S.bp = (uint8_t *)Spy_popPointer(&S);
 	S.sp -= Spy_popInt(&S) * 8;
 	goto dispatch;
 
 	dbon:
+	if (option_flags & SPY_SHARED) goto dispatch;
 	option_flags |= (SPY_DEBUG | SPY_STEP);
+	Spy_instrumentCode(&S, &&instrumented);
 	goto dispatch;
 
 	dboff:
 	option_flags &= ~SPY_DEBUG;
 	option_flags &= ~SPY_STEP;
+	if (!(option_flags & SPY_PROFILE)) {
+		Spy_uninstrumentCode(&S);
+	}
 	goto dispatch;
 
 	dbds:
@@ -583,7 +2385,7 @@ Spy_execute(const char* filename, uint32_t option_flags, int argc, char** argv)
 	a = Spy_popInt(&S); /* location */
 	c = Spy_popInt(&S); /* condition */
 	if (c) {
-		S.ip = (uint8_t *)&S.bytecode[a];
+		S.ip = Spy_codeAt(&S, a);
 	}
 	goto dispatch;
 
@@ -591,24 +2393,20 @@ Spy_execute(const char* filename, uint32_t option_flags, int argc, char** argv)
 	a = Spy_popInt(&S); /* location */
 	c = Spy_popInt(&S); /* condition */
 	if (!c) {
-		S.ip = (uint8_t *)&S.bytecode[a];
+		S.ip = Spy_codeAt(&S, a);
 	}
 	goto dispatch;
 
 	cjmp:
-	S.ip = (uint8_t *)&S.bytecode[Spy_popInt(&S)];
+	S.ip = Spy_codeAt(&S, Spy_popInt(&S));
 	goto dispatch;
 
 	ilnsave:
 	{
-		uint32_t addr = Spy_readInt32(&S);
+		pa = Spy_readLocal(&S);
 		uint32_t numsave = Spy_readInt32(&S);
-		uint64_t* pops = (uint64_t *)malloc(numsave * 8);
-		for (int i = numsave - 1; i >= 0; i--) {
-			pops[i] = Spy_popInt(&S);
-		}
-		memcpy(&S.bp[addr*8 + 8], pops, numsave * 8);
-		free(pops);
+		S.sp -= numsave * 8;
+		memmove(pa, S.sp + 8, numsave * 8);
 	}
 	goto dispatch;
 
@@ -616,25 +2414,54 @@ Spy_execute(const char* filename, uint32_t option_flags, int argc, char** argv)
 	goto dispatch;
 
 	flload:
-	Spy_pushFloat(&S, *(double *)&S.bp[Spy_readInt32(&S)*8 + 8]);
+	Spy_pushFloat(&S, *(double *)Spy_readLocal(&S));
 	goto dispatch;
 
 	flsave:
-	Spy_saveFloat(&S, &S.bp[Spy_readInt32(&S)*8 + 8], Spy_popFloat(&S));
+	Spy_saveFloat(&S, Spy_readLocal(&S), Spy_popFloat(&S));
 	goto dispatch;
 
 	/* ***NOTE*** THIS ADDRESSES OFF THE TOP OF THE STACK */
 	ftoi:
+	quick = S.ip->i == 0 ? &&ftoi_0 : S.ip->i == 1 ? &&ftoi_1 : &&ftoi_n;
+	goto quicken;
+
+	ftoi_n:
 	a = Spy_readInt32(&S);
 	Spy_saveInt(&S, &S.sp[-a*8], (int64_t)(*(double *)&S.sp[-a*8]));
 	goto dispatch;
+
+	/* the top of the stack and the value under it, the usual ones */
+	ftoi_0:
+	S.ip++;
+	Spy_saveInt(&S, S.sp, (int64_t)(*(double *)S.sp));
+	goto dispatch;
+
+	ftoi_1:
+	S.ip++;
+	Spy_saveInt(&S, S.sp - 8, (int64_t)(*(double *)(S.sp - 8)));
+	goto dispatch;
 	
 	/* ***NOTE*** THIS ADDRESSES OFF THE TOP OF THE STACK */
 	itof:
+	quick = S.ip->i == 0 ? &&itof_0 : S.ip->i == 1 ? &&itof_1 : &&itof_n;
+	goto quicken;
+
+	itof_n:
 	a = Spy_readInt32(&S);
 	Spy_saveFloat(&S, &S.sp[-a*8], (double)(*(int64_t *)&S.sp[-a*8]));
 	goto dispatch;
 
+	itof_0:
+	S.ip++;
+	Spy_saveFloat(&S, S.sp, (double)(*(int64_t *)S.sp));
+	goto dispatch;
+
+	itof_1:
+	S.ip++;
+	Spy_saveFloat(&S, S.sp - 8, (double)(*(int64_t *)(S.sp - 8)));
+	goto dispatch;
+
 	fder:
 	Spy_pushFloat(&S, *(double *)&S.memory[Spy_popInt(&S)]);
 	goto dispatch;
@@ -648,13 +2475,595 @@ Spy_execute(const char* filename, uint32_t option_flags, int argc, char** argv)
 	Spy_pushInt(&S, !Spy_popInt(&S));
 	goto dispatch;
 
+	/* register instructions, operands are frame slots (d = a op b) */
+	riset:
+	pa = Spy_readLocal(&S);
+	Spy_saveInt(&S, pa, Spy_readInt64(&S));
+	goto dispatch;
+
+	rfset:
+	pa = Spy_readLocal(&S);
+	Spy_saveFloat(&S, pa, Spy_readFloat(&S));
+	goto dispatch;
+
+	rmov:
+	pa = Spy_readLocal(&S);
+	*(int64_t *)pa = *(int64_t *)Spy_readLocal(&S);
+	goto dispatch;
+
+	riadd:
+	pa = Spy_readLocal(&S);
+	a = *(int64_t *)Spy_readLocal(&S);
+	c = *(int64_t *)Spy_readLocal(&S);
+	Spy_saveInt(&S, pa, a + c);
+	goto dispatch;
+
+	risub:
+	pa = Spy_readLocal(&S);
+	a = *(int64_t *)Spy_readLocal(&S);
+	c = *(int64_t *)Spy_readLocal(&S);
+	Spy_saveInt(&S, pa, a - c);
+	goto dispatch;
+
+	rimul:
+	pa = Spy_readLocal(&S);
+	a = *(int64_t *)Spy_readLocal(&S);
+	c = *(int64_t *)Spy_readLocal(&S);
+	Spy_saveInt(&S, pa, a * c);
+	goto dispatch;
+
+	ridiv:
+	pa = Spy_readLocal(&S);
+	a = *(int64_t *)Spy_readLocal(&S);
+	c = *(int64_t *)Spy_readLocal(&S);
+	Spy_saveInt(&S, pa, a / c);
+	goto dispatch;
+
+	rfadd:
+	pa = Spy_readLocal(&S);
+	b = *(double *)Spy_readLocal(&S);
+	d = *(double *)Spy_readLocal(&S);
+	Spy_saveFloat(&S, pa, b + d);
+	goto dispatch;
+
+	rfsub:
+	pa = Spy_readLocal(&S);
+	b = *(double *)Spy_readLocal(&S);
+	d = *(double *)Spy_readLocal(&S);
+	Spy_saveFloat(&S, pa, b - d);
+	goto dispatch;
+
+	rfmul:
+	pa = Spy_readLocal(&S);
+	b = *(double *)Spy_readLocal(&S);
+	d = *(double *)Spy_readLocal(&S);
+	Spy_saveFloat(&S, pa, b * d);
+	goto dispatch;
+
+	rfdiv:
+	pa = Spy_readLocal(&S);
+	b = *(double *)Spy_readLocal(&S);
+	d = *(double *)Spy_readLocal(&S);
+	Spy_saveFloat(&S, pa, b / d);
+	goto dispatch;
+
+	/* superinstructions, see fusions[] in assembler.c */
+	illadd:
+	a = *(int64_t *)Spy_readLocal(&S);
+	Spy_pushInt(&S, a + *(int64_t *)Spy_readLocal(&S));
+	goto dispatch;
+
+	flladd:
+	b = *(double *)Spy_readLocal(&S);
+	Spy_pushFloat(&S, b + *(double *)Spy_readLocal(&S));
+	goto dispatch;
+
+	fllsub:
+	b = *(double *)Spy_readLocal(&S);
+	Spy_pushFloat(&S, b - *(double *)Spy_readLocal(&S));
+	goto dispatch;
+
+	fllmul:
+	b = *(double *)Spy_readLocal(&S);
+	Spy_pushFloat(&S, b * *(double *)Spy_readLocal(&S));
+	goto dispatch;
+
+	ilinc:
+	a = *(int64_t *)Spy_readLocal(&S);
+	Spy_pushInt(&S, a + Spy_readInt64(&S));
+	goto dispatch;
+
+	ilfield:
+	a = *(int64_t *)Spy_readLocal(&S);
+	Spy_pushInt(&S, *(int64_t *)&S.memory[a + Spy_readInt64(&S)]);
+	goto dispatch;
+
+	flfield:
+	a = *(int64_t *)Spy_readLocal(&S);
+	Spy_pushFloat(&S, *(double *)&S.memory[a + Spy_readInt64(&S)]);
+	goto dispatch;
+
+	icider:
+	a = Spy_popInt(&S);
+	Spy_pushInt(&S, *(int64_t *)&S.memory[a + Spy_readInt64(&S)]);
+	goto dispatch;
+
+	icfder:
+	a = Spy_popInt(&S);
+	Spy_pushFloat(&S, *(double *)&S.memory[a + Spy_readInt64(&S)]);
+	goto dispatch;
+
+	riaddi:
+	pa = Spy_readLocal(&S);
+	a = Spy_readInt64(&S);
+	Spy_saveInt(&S, pa, a);
+	pb = Spy_readLocal(&S);
+	Spy_saveInt(&S, pb, a + *(int64_t *)Spy_readLocal(&S));
+	goto dispatch;
+
+	iltjz:
+	pc = Spy_readTarget(&S);
+	c = Spy_popInt(&S);
+	if (!(Spy_popInt(&S) < c)) {
+		S.ip = pc;
+	}
+	goto dispatch;
+
+	ilejz:
+	pc = Spy_readTarget(&S);
+	c = Spy_popInt(&S);
+	if (!(Spy_popInt(&S) <= c)) {
+		S.ip = pc;
+	}
+	goto dispatch;
+
+	icmpjz:
+	pc = Spy_readTarget(&S);
+	c = Spy_popInt(&S);
+	if (Spy_popInt(&S) != c) {
+		S.ip = pc;
+	}
+	goto dispatch;
+
+	cocreate:
+	pc = Spy_readTarget(&S);
+	a = Spy_readInt32(&S); /* number of arguments */
+	c = Spy_readInt32(&S); /* stack size */
+	Spy_pushInt(&S, Spy_newCoroutine(&S, pc, a, c, coroutine_exit));
+	goto dispatch;
+
+	/* runs a coroutine until it yields or returns, pushes the value */
+	resume:
+	Spy_resumeCoroutine(&S, Spy_popInt(&S));
+	goto dispatch;
+
+	yield:
+	Spy_yieldCoroutine(&S, Spy_popInt(&S));
+	goto dispatch;
+
+	costatus:
+	Spy_pushInt(&S, Spy_getCoroutine(&S, Spy_popInt(&S))->status);
+	goto dispatch;
+
+	/* block operations, the operands are pushed in the order libc takes
+	 * them (address, address or byte, length in bytes).  memcpy's blocks
+	 * can't overlap unless they're the same block
+	 */
+	memcpy:
+	a = Spy_popInt(&S);
+	pb = Spy_checkBlock(&S, Spy_popInt(&S), a);
+	pa = Spy_checkBlock(&S, Spy_popInt(&S), a);
+	if (pa != pb) {
+		memcpy(pa, pb, a);
+	}
+	goto dispatch;
+
+	memset:
+	a = Spy_popInt(&S);
+	c = Spy_popInt(&S);
+	memset(Spy_checkBlock(&S, Spy_popInt(&S), a), (int)c, a);
+	goto dispatch;
+
+	memmove:
+	a = Spy_popInt(&S);
+	pb = Spy_checkBlock(&S, Spy_popInt(&S), a);
+	memmove(Spy_checkBlock(&S, Spy_popInt(&S), a), pb, a);
+	goto dispatch;
+
+	/* four lane vectors take four stack slots, lane 0 lowest.  binary
+	 * operations leave their result in place of the first operand
+	 */
+	vlload:
+	memcpy(S.sp + 8, Spy_readLocal(&S), 32);
+	S.sp += 32;
+	goto dispatch;
+
+	vlsave:
+	S.sp -= 32;
+	memcpy(Spy_readLocal(&S), S.sp + 8, 32);
+	goto dispatch;
+
+	vload:
+	pa = &S.memory[Spy_popInt(&S)];
+	memcpy(S.sp + 8, pa, 32);
+	S.sp += 32;
+	goto dispatch;
+
+	vsave:
+	S.sp -= 32;
+	pb = S.sp + 8;
+	memcpy(&S.memory[Spy_popInt(&S)], pb, 32);
+	goto dispatch;
+
+	vfadd:
+	S.sp -= 32;
+	Spy_vectorFloat(OP_VFADD, (double *)(S.sp - 24), (const double *)(S.sp + 8));
+	goto dispatch;
+
+	vfsub:
+	S.sp -= 32;
+	Spy_vectorFloat(OP_VFSUB, (double *)(S.sp - 24), (const double *)(S.sp + 8));
+	goto dispatch;
+
+	vfmul:
+	S.sp -= 32;
+	Spy_vectorFloat(OP_VFMUL, (double *)(S.sp - 24), (const double *)(S.sp + 8));
+	goto dispatch;
+
+	vfdiv:
+	S.sp -= 32;
+	Spy_vectorFloat(OP_VFDIV, (double *)(S.sp - 24), (const double *)(S.sp + 8));
+	goto dispatch;
+
+	viadd:
+	S.sp -= 32;
+	Spy_vectorInt(OP_VIADD, (int64_t *)(S.sp - 24), (const int64_t *)(S.sp + 8));
+	goto dispatch;
+
+	visub:
+	S.sp -= 32;
+	Spy_vectorInt(OP_VISUB, (int64_t *)(S.sp - 24), (const int64_t *)(S.sp + 8));
+	goto dispatch;
+
+	vimul:
+	S.sp -= 32;
+	Spy_vectorInt(OP_VIMUL, (int64_t *)(S.sp - 24), (const int64_t *)(S.sp + 8));
+	goto dispatch;
+
+	vfcmp:
+	a = Spy_readInt32(&S);
+	S.sp -= 32;
+	Spy_vectorCompareFloat(a, (double *)(S.sp - 24), (const double *)(S.sp + 8));
+	goto dispatch;
+
+	vicmp:
+	a = Spy_readInt32(&S);
+	S.sp -= 32;
+	Spy_vectorCompareInt(a, (int64_t *)(S.sp - 24), (const int64_t *)(S.sp + 8));
+	goto dispatch;
+
+	/* mask, a, b -> the lanes of a where the mask is set, of b elsewhere */
+	vselect:
+	S.sp -= 64;
+	Spy_vectorSelect((int64_t *)(S.sp - 24), (const int64_t *)(S.sp + 8), (const int64_t *)(S.sp + 40));
+	goto dispatch;
+
+	/* the scalar (operand) values down is repeated into four lanes */
+	vsplat:
+	a = Spy_readInt32(&S);
+	pa = S.sp - a*8;
+	c = *(int64_t *)pa;
+	memmove(pa + 32, pa + 8, a*8);
+	for (int lane = 0; lane < 4; lane++) {
+		*(int64_t *)&pa[lane*8] = c;
+	}
+	S.sp += 24;
+	goto dispatch;
+
+	vlane:
+	a = Spy_readInt32(&S);
+	c = *(int64_t *)(S.sp - 24 + a*8);
+	S.sp -= 24;
+	*(int64_t *)S.sp = c;
+	goto dispatch;
+
+	/* math the compiler emits for the libm cfuncs, instead of ccall.  min
+	 * and max are a < b ? a : b (minsd), not fmin, so NaNs give b
+	 */
+	fsqrt:
+	Spy_pushFloat(&S, sqrt(Spy_popFloat(&S)));
+	goto dispatch;
+
+	fsin:
+	Spy_pushFloat(&S, sin(Spy_popFloat(&S)));
+	goto dispatch;
+
+	fcos:
+	Spy_pushFloat(&S, cos(Spy_popFloat(&S)));
+	goto dispatch;
+
+	ftan:
+	Spy_pushFloat(&S, tan(Spy_popFloat(&S)));
+	goto dispatch;
+
+	fabs:
+	Spy_pushFloat(&S, fabs(Spy_popFloat(&S)));
+	goto dispatch;
+
+	ffloor:
+	Spy_pushFloat(&S, floor(Spy_popFloat(&S)));
+	goto dispatch;
+
+	fceil:
+	Spy_pushFloat(&S, ceil(Spy_popFloat(&S)));
+	goto dispatch;
+
+	fmin:
+	b = Spy_popFloat(&S);
+	d = Spy_popFloat(&S);
+	Spy_pushFloat(&S, d < b ? d : b);
+	goto dispatch;
+
+	fmax:
+	b = Spy_popFloat(&S);
+	d = Spy_popFloat(&S);
+	Spy_pushFloat(&S, d > b ? d : b);
+	goto dispatch;
+
+	/* a, b, c -> a*b + c, rounded once */
+	ffma:
+	b = Spy_popFloat(&S);
+	d = Spy_popFloat(&S);
+	Spy_pushFloat(&S, fma(Spy_popFloat(&S), d, b));
+	goto dispatch;
+
+	imin:
+	c = Spy_popInt(&S);
+	a = Spy_popInt(&S);
+	Spy_pushInt(&S, a < c ? a : c);
+	goto dispatch;
+
+	imax:
+	c = Spy_popInt(&S);
+	a = Spy_popInt(&S);
+	Spy_pushInt(&S, a > c ? a : c);
+	goto dispatch;
+
+	iabs:
+	a = Spy_popInt(&S);
+	Spy_pushInt(&S, a < 0 ? -a : a);
+	goto dispatch;
+
+#if SPY_TOS_CACHE
+	/* one variant of an instruction, (IN) and (OUT) are the stack states
+	 * it's entered and left in.  (statement) sees the values it pops as x0
+	 * (the top) and x1, and sets r to the value it pushes.  instructions
+	 * that pop fewer than two leave x0 or x1 alone
+	 */
+	#define SPY_TOS_VARIANT(name, IN, OUT, pops, pushes, statement) \
+	name##_##IN##OUT: { \
+		int64_t x0 = 0, x1 = 0, r = 0; \
+		if ((pops) >= 1) { \
+			x0 = (IN) ? tos : *(int64_t *)S.sp; \
+		} else if (IN) { \
+			*(int64_t *)S.sp = tos; \
+		} \
+		if ((pops) >= 2) { \
+			x1 = *(int64_t *)(S.sp - 8); \
+		} \
+		S.sp -= (pops)*8; \
+		statement; \
+		(void)x0; (void)x1; \
+		if (pushes) { \
+			S.sp += 8; \
+			if (OUT) tos = r; else *(int64_t *)S.sp = r; \
+		} else if (OUT) { \
+			tos = *(int64_t *)S.sp; \
+		} \
+		goto dispatch; \
+	}
+
+	#define SPY_TOS_HANDLER(name, pops, pushes, statement) \
+	SPY_TOS_VARIANT(name, 0, 0, pops, pushes, statement) \
+	SPY_TOS_VARIANT(name, 0, 1, pops, pushes, statement) \
+	SPY_TOS_VARIANT(name, 1, 0, pops, pushes, statement) \
+	SPY_TOS_VARIANT(name, 1, 1, pops, pushes, statement)
+
+	SPY_TOS_HANDLER(ipush, 0, 1, r = Spy_readInt64(&S))
+	SPY_TOS_HANDLER(fpush, 0, 1, r = Spy_readInt64(&S))
+	SPY_TOS_HANDLER(ilload, 0, 1, r = *(int64_t *)Spy_readLocal(&S))
+	SPY_TOS_HANDLER(flload, 0, 1, r = *(int64_t *)Spy_readLocal(&S))
+	SPY_TOS_HANDLER(ilsave, 1, 0, *(int64_t *)Spy_readLocal(&S) = x0)
+	SPY_TOS_HANDLER(flsave, 1, 0, *(int64_t *)Spy_readLocal(&S) = x0)
+	SPY_TOS_HANDLER(iarg, 0, 1, r = *(int64_t *)&S.bp[-3*8 - Spy_readInt32(&S)*8])
+	SPY_TOS_HANDLER(lea, 0, 1, r = Spy_readLocal(&S) - S.memory)
+	SPY_TOS_HANDLER(iadd, 2, 1, r = x1 + x0)
+	SPY_TOS_HANDLER(isub, 2, 1, r = x1 - x0)
+	SPY_TOS_HANDLER(imul, 2, 1, r = x1 * x0)
+	SPY_TOS_HANDLER(and, 2, 1, r = x1 & x0)
+	SPY_TOS_HANDLER(or, 2, 1, r = x1 | x0)
+	SPY_TOS_HANDLER(xor, 2, 1, r = x1 ^ x0)
+	SPY_TOS_HANDLER(not, 1, 1, r = ~x0)
+	SPY_TOS_HANDLER(neg, 1, 1, r = -x0)
+	SPY_TOS_HANDLER(igt, 2, 1, r = x1 > x0)
+	SPY_TOS_HANDLER(ige, 2, 1, r = x1 >= x0)
+	SPY_TOS_HANDLER(ilt, 2, 1, r = x1 < x0)
+	SPY_TOS_HANDLER(ile, 2, 1, r = x1 <= x0)
+	SPY_TOS_HANDLER(icmp, 2, 1, r = x1 == x0)
+	SPY_TOS_HANDLER(lor, 2, 1, r = x1 || x0)
+	SPY_TOS_HANDLER(land, 2, 1, r = x1 && x0)
+	SPY_TOS_HANDLER(lnot, 1, 1, r = !x0)
+	SPY_TOS_HANDLER(padd, 2, 1, r = x1 + x0*8)
+	SPY_TOS_HANDLER(psub, 2, 1, r = x1 - x0*8)
+	SPY_TOS_HANDLER(fadd, 2, 1, r = Spy_asInt(Spy_asFloat(x1) + Spy_asFloat(x0)))
+	SPY_TOS_HANDLER(fsub, 2, 1, r = Spy_asInt(Spy_asFloat(x1) - Spy_asFloat(x0)))
+	SPY_TOS_HANDLER(fmul, 2, 1, r = Spy_asInt(Spy_asFloat(x1) * Spy_asFloat(x0)))
+	SPY_TOS_HANDLER(fdiv, 2, 1, r = Spy_asInt(Spy_asFloat(x1) / Spy_asFloat(x0)))
+	SPY_TOS_HANDLER(fgt, 2, 1, r = Spy_asInt(Spy_asFloat(x1) > Spy_asFloat(x0)))
+	SPY_TOS_HANDLER(fge, 2, 1, r = Spy_asInt(Spy_asFloat(x1) >= Spy_asFloat(x0)))
+	SPY_TOS_HANDLER(flt, 2, 1, r = Spy_asInt(Spy_asFloat(x1) < Spy_asFloat(x0)))
+	SPY_TOS_HANDLER(fle, 2, 1, r = Spy_asInt(Spy_asFloat(x1) <= Spy_asFloat(x0)))
+	SPY_TOS_HANDLER(fcmp, 2, 1, r = Spy_asFloat(x1) == Spy_asFloat(x0))
+	SPY_TOS_HANDLER(ider, 1, 1, r = *(int64_t *)&S.memory[x0])
+	SPY_TOS_HANDLER(fder, 1, 1, r = *(int64_t *)&S.memory[x0])
+	SPY_TOS_HANDLER(cder, 1, 1, r = S.memory[x0])
+	SPY_TOS_HANDLER(iload, 1, 1, r = *(int64_t *)&S.memory[(uint64_t)x0])
+	SPY_TOS_HANDLER(isave, 2, 0, *(int64_t *)&S.memory[x1] = x0)
+	SPY_TOS_HANDLER(fsave, 2, 0, *(int64_t *)&S.memory[x1] = x0)
+	SPY_TOS_HANDLER(icinc, 1, 1, r = x0 + Spy_readInt64(&S))
+	SPY_TOS_HANDLER(icnop, 1, 1, r = x0; S.ip++)
+	SPY_TOS_HANDLER(illadd, 0, 1, a = *(int64_t *)Spy_readLocal(&S); r = a + *(int64_t *)Spy_readLocal(&S))
+	SPY_TOS_HANDLER(flladd, 0, 1, b = *(double *)Spy_readLocal(&S); r = Spy_asInt(b + *(double *)Spy_readLocal(&S)))
+	SPY_TOS_HANDLER(fllsub, 0, 1, b = *(double *)Spy_readLocal(&S); r = Spy_asInt(b - *(double *)Spy_readLocal(&S)))
+	SPY_TOS_HANDLER(fllmul, 0, 1, b = *(double *)Spy_readLocal(&S); r = Spy_asInt(b * *(double *)Spy_readLocal(&S)))
+	SPY_TOS_HANDLER(ilinc, 0, 1, a = *(int64_t *)Spy_readLocal(&S); r = a + Spy_readInt64(&S))
+	SPY_TOS_HANDLER(ilfield, 0, 1, a = *(int64_t *)Spy_readLocal(&S); r = *(int64_t *)&S.memory[a + Spy_readInt64(&S)])
+	SPY_TOS_HANDLER(flfield, 0, 1, a = *(int64_t *)Spy_readLocal(&S); r = *(int64_t *)&S.memory[a + Spy_readInt64(&S)])
+	SPY_TOS_HANDLER(icider, 1, 1, r = *(int64_t *)&S.memory[x0 + Spy_readInt64(&S)])
+	SPY_TOS_HANDLER(icfder, 1, 1, r = *(int64_t *)&S.memory[x0 + Spy_readInt64(&S)])
+
+	/* branches always leave the stack in memory, see Spy_cacheStack */
+	SPY_TOS_HANDLER(jz, 1, 0, pc = Spy_readTarget(&S); if (!x0) S.ip = pc)
+	SPY_TOS_HANDLER(jnz, 1, 0, pc = Spy_readTarget(&S); if (x0) S.ip = pc)
+	SPY_TOS_HANDLER(iltjz, 2, 0, pc = Spy_readTarget(&S); if (!(x1 < x0)) S.ip = pc)
+	SPY_TOS_HANDLER(ilejz, 2, 0, pc = Spy_readTarget(&S); if (!(x1 <= x0)) S.ip = pc)
+	SPY_TOS_HANDLER(icmpjz, 2, 0, pc = Spy_readTarget(&S); if (x1 != x0) S.ip = pc)
+
+	#undef SPY_TOS_HANDLER
+	#undef SPY_TOS_VARIANT
+#endif
+
+	/* not an opcode, a coroutine's function returned */
+	coreturn:
+	Spy_finishCoroutine(&S);
+	goto dispatch;
+
 	done:
 	if (option_flags & SPY_DEBUG) {
 		printf("\nSpyre process terminated\n");
 		printf("%d instructions were executed\n", total);
 	}
+	if (option_flags & SPY_PROFILE) {
+		if (ipsave) {
+			profile_cycles[S.code_ops[ipsave - S.code]] += Spy_cycles() - profile_last;
+		}
+		Spy_writeProfile(S.filename, profile_counts, profile_cycles);
+	}
+	Spy_uninstrumentCode(&S);
+	*state = S;
+
+}
+
+/* threads, verifies and (with SPY_JIT) compiles the loaded program, which
+ * Spy_run and Spy_call otherwise do the first time they're called
+ */
+void
+Spy_prepare(SpyState* S) {
+	Spy_interpret(S, SPY_PREPARE);
+}
+
+/* pushes the command line and the frame the code at the start runs in */
+void
+Spy_pushArguments(SpyState* S, int argc, char** argv) {
+	/* push command line arguments */
+	for (int i = argc - 1; i >= 0; i--) {
+		Spy_pushInt(S, strlen(argv[i]));
+		SpyL_malloc(S);
+		/* allocated space for the string, now find tail of malloc blocks */
+		SpyMemoryChunk* chunk = S->memory_chunks;
+		while (chunk->next) chunk = chunk->next;
+		strcpy((char *)chunk->absolute_address, argv[i]);
+	}
+
+	/* push ng */
+	Spy_pushInt(S, argc);
+
+	/* push junk for ng, ip, and bp onto the stack to maintain alignment for arg instruction */
+	Spy_pushInt(S, 0x7369DB6469766164);
+	Spy_pushInt(S, 0xDB6C6F6F63DB61DB);
+	Spy_pushInt(S, 0x212121212164696B);
+	/* assign BP to SP to simulate a function call */
+	S->bp = S->sp;
+}
+
+/* runs the program loaded into (S) from the start, call Spy_reset before
+ * running it again
+ */
+void
+Spy_run(SpyState* S, int argc, char** argv) {
+	Spy_pushArguments(S, argc, argv);
+	Spy_interpret(S, 0);
+}
+
+/* carries on running a state restored by Spy_restore */
+void
+Spy_resume(SpyState* S) {
+	if (!S->ip) {
+		Spy_crash(S, "nothing to resume");
+	}
+	Spy_interpret(S, SPY_CONTINUE);
+}
+
+/* calls the function at bytecode offset (entry) with (nargs) integer 
+ * arguments, in the order they'd be pushed.  it returns to the noop at the 
+ * end of the code, so the interpreter stops there with the return value 
+ * (if any) on top of the stack
+ */
+int64_t
+Spy_call(SpyState* S, uint32_t entry, const int64_t* args, uint32_t nargs) {
+	uint8_t* base = S->sp;
+	if (!S->code) {
+		Spy_prepare(S);
+	}
+	for (uint32_t i = 0; i < nargs; i++) {
+		Spy_pushInt(S, args[i]);
+	}
+	Spy_pushInt(S, nargs);
+	Spy_pushPointer(S, (void *)S->bp);
+	Spy_pushPointer(S, (void *)&S->code[S->code_map[S->bytecode_size]]);
+	S->bp = S->sp;
+	Spy_interpret(S, entry);
+	return S->sp > base ? Spy_popInt(S) : 0;
+}
 
-	return;
+/* makes (S) run the program already loaded and prepared in (program),
+ * the code is shared (never patched again) so both can run at once
+ */
+void
+Spy_share(SpyState* S, SpyState* program) {
+	if (!program->code) {
+		Spy_prepare(program);
+	}
+	if (program->rom_size > S->start_stack) {
+		Spy_crash(S, "ROM of '%s' doesn't fit in memory", program->filename);
+	}
+	while (S->c_functions) {
+		SpyCFunction* next = S->c_functions->next;
+		free(S->c_functions);
+		S->c_functions = next;
+	}
+	free(S->c_table);
+	S->filename = program->filename;
+	S->file = program->file;
+	S->file_size = program->file_size;
+	S->bytecode = program->bytecode;
+	S->bytecode_size = program->bytecode_size;
+	S->rom_size = program->rom_size;
+	S->code = program->code;
+	S->code_ops = program->code_ops;
+	S->code_map = program->code_map;
+	S->c_functions = program->c_functions;
+	S->c_table = program->c_table;
+	S->c_count = program->c_count;
+	S->jit = program->jit;
+	S->option_flags = (program->option_flags & ~(SPY_DEBUG | SPY_STEP | SPY_PROFILE | SPY_TRACE | SPY_TIER)) | SPY_SHARED;
+	memcpy(S->memory, S->bytecode - S->rom_size, S->rom_size);
+}
 
+void
+Spy_execute(const char* filename, uint32_t option_flags, int argc, char** argv) {
+	SpyState* S = Spy_newState(option_flags);
+	Spy_load(S, filename);
+	Spy_run(S, argc, argv);
 }
 
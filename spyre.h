@@ -8,24 +8,88 @@
 #define SPY_NOFLAG	0x00
 #define SPY_DEBUG	0x01
 #define SPY_STEP	0x02
+#define SPY_JIT		0x04	/* compile functions to native code when available */
+#define SPY_TRACE	0x08	/* compile hot loops to native code when available */
+#define SPY_PROFILE	0x10	/* count executions and cycles of each opcode */
+#define SPY_SHARED	0x20	/* code is shared with other states, never patch it */
+#define SPY_TIER	0x40	/* promote functions as they get hot, see SpyTier */
+
+/* the interpreter keeps the top of the stack in a local between the
+ * instructions that allow it, build with -DSPY_TOS_CACHE=0 for the plain loop
+ */
+#ifndef SPY_TOS_CACHE
+#define SPY_TOS_CACHE	1
+#endif
+
+/* tiers of a function with SPY_TIER, and the calls plus backward jumps
+ * that promote it to the next one
+ */
+#define SPY_TIER_INTERPRETED	0
+#define SPY_TIER_SPECIALIZED	1	/* stack cached handlers (see SPY_TOS_CACHE) */
+#define SPY_TIER_NATIVE			2	/* compiled, where there's a JIT */
+#define SPY_TIER_WARM			100
+#define SPY_TIER_HOT			1000
+
+/* code_ops value of cells that hold operands */
+#define SPY_OPERAND	0xFF
+#define SPY_NOCELL	0xFFFFFFFF
+
+/* coroutine status, see costatus */
+#define SPY_COSUSPENDED	0
+#define SPY_CORUNNING	1
+#define SPY_CODEAD		2
+
+/* lane comparisons of vfcmp and vicmp, each lane becomes all ones or zero */
+#define SPY_VEQ	0
+#define SPY_VNE	1
+#define SPY_VLT	2
+#define SPY_VLE	3
+#define SPY_VGT	4
+#define SPY_VGE	5
 
 /* runtime flags */
 #define SPY_CMPRESULT 0x01
 
-/* constants */
-#define SIZE_MEMORY 0x500000
-#define SIZE_STACK	0x100000
+/* bytecode file header, magic, the offsets of the ROM and the code then
+ * the format version.  files of any other version are rejected, they have
+ * to be rebuilt with spy a
+ *	1 -> ccall has (function, arguments, results) operands
+ *	2 -> arguments are pushed in order, the last one is iarg 0
+ */
+#define SPY_MAGIC	0x5950535F
+#define SPY_FORMAT	2
+#define SIZE_HEADER	16
+
+/* constants, memory is laid out as ROM, stack, guard page then heap with
+ * the sizes given to Spy_newStateSized (these are the defaults)
+ */
 #define SIZE_ROM	0x100000
+#define SIZE_STACK	0x100000
+#define SIZE_HEAP	0x40000000	/* reserved, committed as the allocator hands it out */
+#define SIZE_COMMIT	0x10000		/* heap is committed this much at a time */
 #define SIZE_PAGE	8
+#define SIZE_GUARD	0x1000	/* PROT_NONE page at the top of the stack */
+#define SIZE_COSTACK	0x100	/* smallest coroutine stack */
 
 #define START_ROM	0
-#define START_STACK	(SIZE_ROM)
-#define START_HEAP	(SIZE_ROM + SIZE_STACK)
 
 typedef struct SpyState SpyState;
 typedef struct SpyCFunction SpyCFunction;
 typedef struct SpyMemoryChunk SpyMemoryChunk;
-
+typedef union SpyCell SpyCell;
+typedef struct SpyJIT SpyJIT;
+typedef struct SpyCoroutine SpyCoroutine;
+typedef struct SpyTier SpyTier;
+
+/* one cell of pre-decoded (direct threaded) code, an instruction is a 
+ * handler cell followed by one cell per operand
+ */
+union SpyCell {
+	const void*		handler;
+	const SpyCell*	target;	/* jump/call targets */
+	int64_t			i;		/* integers, frame slots (as byte offsets from bp) */
+	double			f;
+};
 
 struct SpyCFunction {
 	const char*		identifier;
@@ -33,6 +97,34 @@ struct SpyCFunction {
 	SpyCFunction*	next;
 };
 
+/* a coroutine's context while it's suspended, and its resumer's while it
+ * runs (they're swapped on resume and yield)
+ */
+struct SpyCoroutine {
+	const SpyCell*	ip;
+	uint8_t*		sp;
+	uint8_t*		bp;
+	uint8_t*		stack_limit;
+	uint64_t		stack;		/* vm address of its stack, from the allocator */
+	uint32_t		resumer;	/* coroutine that resumed it, 0 for the main stack */
+	uint32_t		next_dead;	/* once dead, the next dead coroutine */
+	uint8_t			status;
+};
+
+/* hotness of a function (the cells from a call target to the next one)
+ * and when it reached each tier, in cycles from when the code was prepared
+ */
+struct SpyTier {
+	uint32_t		start;
+	uint32_t		end;
+	uint64_t		calls;
+	uint64_t		loops;		/* backward jumps taken inside it */
+	uint64_t		next;		/* calls + loops that promote it, UINT64_MAX at the top */
+	uint8_t			tier;
+	uint64_t		promoted[3];
+	uint64_t		cost[3];	/* cycles spent promoting it */
+};
+
 struct SpyMemoryChunk {
 	size_t			pages;
 	uint8_t*		absolute_address;
@@ -44,22 +136,54 @@ struct SpyMemoryChunk {
 struct SpyState {
 	size_t			static_memory_size;
 	uint8_t*		static_memory;
+	const char*		filename;	/* bytecode file loaded, for reports */
+	uint8_t*		file;		/* all of it, mapped read-only */
+	size_t			file_size;
 	uint8_t*		bytecode;
+	size_t			bytecode_size;
+	size_t			rom_size;	/* bytes of ROM loaded from the bytecode file */
+	int				rom_mapped;	/* ROM is the file's pages (copy on write) rather than a copy */
+	uint64_t		start_stack;	/* memory layout, the ROM ends where the stack starts */
+	uint64_t		start_heap;
+	uint64_t		size_memory;
+	uint64_t		heap_committed;	/* end of the heap that can be accessed */
+	int				mapped;		/* memory maps a snapshot file, see Spy_restore */
+	SpyCell*		code;		/* bytecode translated at load */
+	uint8_t*		code_ops;	/* opcode of each cell, SPY_OPERAND for operands */
+	uint32_t*		code_map;	/* bytecode offset -> cell index */
+	const void**	saved_handlers;	/* production handlers, while instrumented */
 	uint8_t*		memory;
-	const uint8_t*	ip;
+	const SpyCell*	ip;
 	uint8_t*		sp;
 	uint8_t*		bp;
+	uint8_t*		stack_limit;	/* end of the running stack, checked by enter */
+	SpyCoroutine*	coroutines;	/* coroutine n is coroutines[n - 1] */
+	uint32_t		coroutine_count;
+	uint32_t		coroutine_capacity;
+	uint32_t		coroutine_dead;	/* dead coroutine whose slot cocreate reuses, 0 for none */
+	uint32_t		coroutine;	/* running coroutine, 0 for the main stack */
 	uint32_t		option_flags;
 	uint32_t		runtime_flags;
 	SpyCFunction*	c_functions;
+	uint32_t		(**c_table)(SpyState*);	/* ccall operands index this, in push order */
+	uint32_t		c_count;
 	SpyMemoryChunk*	memory_chunks;
+	uint64_t		heap_top;	/* end of the highest chunk allocated since the last reset */
+	SpyJIT*			jit;		/* NULL when running interpreted */
+	SpyTier*		tiers;		/* SPY_TIER, every function's */
+	uint32_t		tier_count;
+	uint32_t*		tier_of;	/* function of each cell */
+	uint64_t		tier_clock;	/* cycles when the code was prepared */
 };
 
 SpyState*	Spy_newState(uint32_t);
+SpyState*	Spy_newStateSized(uint32_t, uint64_t, uint64_t, uint64_t);
+void		Spy_growHeap(SpyState*, uint64_t);
 void		Spy_log(SpyState*, const char*, ...);
 void		Spy_crash(SpyState*, const char*, ...);
 void		Spy_dumpStack(SpyState*);
 void		Spy_dumpHeap(SpyState*);
+void		Spy_dumpTiers(SpyState*);
 
 void		Spy_pushInt(SpyState*, int64_t);
 int64_t 	Spy_popInt(SpyState*);
@@ -67,6 +191,12 @@ void		Spy_saveInt(SpyState*, uint8_t*, int64_t);
 void		Spy_saveFloat(SpyState*, uint8_t*, double);
 uint64_t	Spy_readInt32(SpyState*);
 uint64_t	Spy_readInt64(SpyState*);
+uint8_t*	Spy_readLocal(SpyState*);
+const SpyCell*	Spy_readTarget(SpyState*);
+const SpyCell*	Spy_codeAt(SpyState*, uint64_t);
+int64_t		Spy_findC(SpyState*, const char*);
+int			Spy_instructionEffect(uint8_t, const SpyCell*, int64_t, int64_t*, int64_t*);
+int			Spy_stackEffect(const SpyState*, size_t, const uint8_t*, int64_t*, int64_t*);
 
 void		Spy_pushPointer(SpyState*, void*);
 void*		Spy_popPointer(SpyState*);
@@ -81,6 +211,18 @@ char*		Spy_popString(SpyState*);
 uint8_t*	Spy_popRaw(SpyState*);
 
 void		Spy_pushC(SpyState*, const char*, uint32_t (*)(SpyState*));
+void		Spy_load(SpyState*, const char*);
+void		Spy_loadROM(SpyState*, const uint8_t*, size_t, const char*);
+void		Spy_prepare(SpyState*);
+void		Spy_pushArguments(SpyState*, int, char**);
+void		Spy_run(SpyState*, int, char**);
+int64_t		Spy_call(SpyState*, uint32_t, const int64_t*, uint32_t);
+void		Spy_share(SpyState*, SpyState*);
+void		Spy_reset(SpyState*);
+void		Spy_freeState(SpyState*);
+void		Spy_snapshot(SpyState*, const char*);
+void		Spy_restore(SpyState*, const char*);
+void		Spy_resume(SpyState*);
 void		Spy_execute(const char*, uint32_t, int, char**);
 
 #endif